@@ -3,5 +3,9 @@ CREATE TABLE chat (
     sender_id INTEGER,
     receiver_id INTEGER,
     timestamp BIGINT,
-    message TEXT
-);
\ No newline at end of file
+    message TEXT,
+    body_format INTEGER DEFAULT 0,
+    conversation INTEGER
+);
+
+CREATE INDEX chat_conversation_id ON chat (conversation, id);
\ No newline at end of file
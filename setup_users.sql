@@ -3,7 +3,9 @@ CREATE TABLE user (
     user_name TEXT NOT NULL,
     password TEXT NOT NULL,
     sessdata INTEGER,
-    slogan TEXT
+    slogan TEXT,
+    icon_hash TEXT,
+    name_version INTEGER NOT NULL DEFAULT 0
 );
 
 CREATE TABLE friend_request (
@@ -13,10 +15,23 @@ CREATE TABLE friend_request (
     UNIQUE (requester_id, requestee_id)
 );
 
+CREATE INDEX friend_request_requestee ON friend_request (requestee_id);
+
 CREATE TABLE relation (
     id INTEGER PRIMARY KEY AUTOINCREMENT,
     user_id INTEGER,
     friend_id INTEGER, 
     unread INTEGER DEFAULT 0,
     UNIQUE (user_id, friend_id)
+);
+
+CREATE TABLE revoked_token (
+    signature TEXT PRIMARY KEY,
+    expiry INTEGER
+);
+
+CREATE TABLE session (
+    sessdata INTEGER PRIMARY KEY,
+    user_id INTEGER NOT NULL,
+    expiry INTEGER NOT NULL
 );
\ No newline at end of file
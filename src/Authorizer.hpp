@@ -4,12 +4,30 @@
 #include <iostream>
 #include <random>
 #include <mutex>
+#include <condition_variable>
 #include <fstream>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+#include <tuple>
+#include <thread>
+#include <functional>
+#include <future>
+#include <atomic>
+#include <algorithm>
+#include <chrono>
+#include <ctime>
 
 #include <sqlite3.h>
 #include <SQLiteCpp/SQLiteCpp.h>
 #include <json/json.h>
 
+#include "IconUpload.hpp"
+#include "SessionToken.hpp"
+#include "Timers.hpp"
+#include "EventBus.hpp"
+#include "Presence.hpp"
+
 class Authorizer {
 public:
     enum class Result {
@@ -32,16 +50,159 @@ public:
         CANNOT_REQUEST_SELF,
     };
 
+    struct UserProfile {
+        std::string name;
+        std::string slogan;
+        std::string icon;   // File name of the icon, empty if the user has not uploaded one
+    };
+
 private:
     SQLite::Database db{ "users.db", SQLite::OPEN_READWRITE | SQLite::OPEN_CREATE };
     std::mutex db_mutex;
 
-    std::unordered_multimap<int, std::pair<int, int>> cache;
-    std::mutex cache_mutex;
+    // Unread counts keyed by unread_key(user_id, friend_id).
+    // This table is authoritative, the unread column of relation is only its persisted copy.
+    std::unordered_map<uint64_t, int> unread;
+    // Counts changed since they were last written to the database
+    std::unordered_set<uint64_t> unread_dirty;
+    std::mutex unread_mutex;
+    std::condition_variable unread_cond;
+
+    // Changes are gathered for a while, so a busy conversation is written once per batch
+    static constexpr std::chrono::milliseconds unread_flush_delay{ 500 };
+
+    // Names, slogans and icons of users, entries are dropped when they are modified
+    std::unordered_map<int, UserProfile> profiles;
+    std::mutex profile_mutex;
+
+    // Pending friend requests, the requesters of every requestee, kept with the friend_request table
+    std::unordered_map<int, std::unordered_set<int>> requesters;
+    std::mutex request_mutex;
+
+public:
+    static constexpr long long session_lifetime = 1296000;     // Seconds, also the Max-Age of the cookies
+
+private:
+    struct Session {
+        int user_id;
+        long long expiry;
+        Timers::Id timer;
+    };
+
+    // Every session of the session table, so authorize never queries the database.
+    // A user has a session per device, up to max_sessions_per_user.
+    std::unordered_map<unsigned int, Session> sessions;
+    std::unordered_map<int, std::vector<unsigned int>> sessions_of_user;
+    // Sessions are ended by a timer when they expire, requests do not look at the expiry
+    Timers& timers = Timers::get_instance();
+    std::mt19937 sessdata_rand{ std::random_device{}() };
+    std::mutex session_mutex;
+
+    static constexpr size_t max_sessions_per_user = 16;
+
+    // Current name of every user and the version of it, so tokens are checked in memory.
+    // A rename bumps the version, which retires the tokens issued under the old name.
+    // Guarded by session_mutex, like the token revocations.
+    std::unordered_map<int, std::pair<unsigned, std::string>> user_names;
+    // Signatures of tokens that were logged out before they expired, with their expiry
+    std::unordered_map<std::string, long long> revoked_tokens;
+    SessionToken tokens{ "session.key" };
+    EventBus& events = EventBus::get_instance();
+    Presence& presence = Presence::get_instance();
+
+    // A write queued for the writer thread.
+    // apply runs inside the transaction of its batch under db_mutex, on_commit runs after the commit
+    // while db_mutex is still held (so caches change together with the database),
+    // done is called last with the result, which is FAILED if the batch could not be committed.
+    struct Mutation {
+        std::function<Result()> apply;
+        std::function<void()> on_commit;
+        std::function<void(Result)> done;
+    };
+    std::vector<Mutation> mutations;
+    std::mutex mutation_mutex;
+    std::condition_variable mutation_cond;
+
+    std::atomic<unsigned long long> write_batches{ 0 };
+    std::atomic<unsigned long long> written_mutations{ 0 };
+    std::atomic<size_t> peak_write_batch{ 0 };
 
     Authorizer() {
-        std::thread t(std::bind(&Authorizer::write_cache_to_database, this));
+        db.exec("CREATE INDEX IF NOT EXISTS friend_request_requestee ON friend_request (requestee_id)");
+        upgrade_schema();
+
+        SQLite::Statement q1(db, "SELECT user_id, friend_id, unread FROM relation WHERE unread>0");
+        while (q1.executeStep())
+            unread[unread_key(q1.getColumn(0).getInt(), q1.getColumn(1).getInt())] = q1.getColumn(2).getInt();
+
+        SQLite::Statement q7(db, "SELECT user_id, friend_id FROM relation");
+        while (q7.executeStep())
+            presence.add_friend(q7.getColumn(0).getInt(), q7.getColumn(1).getInt());
+
+        SQLite::Statement q8(db, "SELECT requester_id, requestee_id FROM friend_request");
+        while (q8.executeStep())
+            requesters[q8.getColumn(1).getInt()].insert(q8.getColumn(0).getInt());
+
+        SQLite::Statement q2(db, "SELECT id, name_version, user_name FROM user");
+        while (q2.executeStep())
+            user_names[q2.getColumn(0).getInt()] = { static_cast<unsigned>(q2.getColumn(1).getInt64()), q2.getColumn(2).getString() };
+
+        SQLite::Statement q5(db, "DELETE FROM session WHERE expiry<=?");
+        q5.bind(1, static_cast<int64_t>(time(nullptr)));
+        q5.exec();
+        SQLite::Statement q6(db, "SELECT sessdata, user_id, expiry FROM session");
+        while (q6.executeStep()) {
+            auto sessdata = static_cast<unsigned int>(q6.getColumn(0).getInt64());
+            Session session{ q6.getColumn(1).getInt(), q6.getColumn(2).getInt64(), 0 };
+            sessions[sessdata] = session;
+            sessions_of_user[session.user_id].push_back(sessdata);
+            schedule_expiry(sessdata);
+        }
+
+        SQLite::Statement q3(db, "DELETE FROM revoked_token WHERE expiry<=?");
+        q3.bind(1, static_cast<int64_t>(time(nullptr)));
+        q3.exec();
+        SQLite::Statement q4(db, "SELECT signature, expiry FROM revoked_token");
+        while (q4.executeStep())
+            revoked_tokens[q4.getColumn(0).getString()] = q4.getColumn(1).getInt64();
+
+        std::thread t(std::bind(&Authorizer::write_unread_to_database, this));
         t.detach();
+        std::thread writer(std::bind(&Authorizer::write_mutations, this));
+        writer.detach();
+    }
+
+    void upgrade_schema() {
+        bool has_icon_hash = false, has_name_version = false;
+        {
+            SQLite::Statement q1(db, "PRAGMA table_info(user)");
+            while (q1.executeStep()) {
+                auto column = q1.getColumn(1).getString();
+                if (column == "icon_hash")
+                    has_icon_hash = true;
+                else if (column == "name_version")
+                    has_name_version = true;
+            }
+        }
+        if (!has_icon_hash)
+            db.exec("ALTER TABLE user ADD COLUMN icon_hash TEXT");
+        if (!has_name_version)
+            db.exec("ALTER TABLE user ADD COLUMN name_version INTEGER NOT NULL DEFAULT 0");
+        db.exec("CREATE TABLE IF NOT EXISTS revoked_token (signature TEXT PRIMARY KEY, expiry INTEGER)");
+
+        SQLite::Statement q2(db, "SELECT 1 FROM sqlite_master WHERE type='table' AND name='session'");
+        if (!q2.executeStep()) {
+            db.exec("CREATE TABLE session (sessdata INTEGER PRIMARY KEY, user_id INTEGER NOT NULL, expiry INTEGER NOT NULL)");
+            // The one session each user had in user.sessdata
+            SQLite::Statement q3(db, "INSERT OR IGNORE INTO session (sessdata, user_id, expiry) "
+                "SELECT sessdata, id, ? FROM user WHERE sessdata IS NOT NULL");
+            q3.bind(1, static_cast<int64_t>(time(nullptr) + session_lifetime));
+            q3.exec();
+        }
+    }
+
+    static uint64_t unread_key(int user_id, int friend_id) {
+        return (static_cast<uint64_t>(static_cast<uint32_t>(user_id)) << 32) | static_cast<uint32_t>(friend_id);
     }
 public:
     static Authorizer& get_instance() {
@@ -55,29 +216,33 @@ public:
         if (password.empty())
             return Result::PASSWORD_EMPTY;
 
-        {
-            std::lock_guard<std::mutex> lock(db_mutex);
+        int id = 0;
+        return write([this, &user_name, &password, &id] {
             SQLite::Statement query_dup(db, "SELECT * FROM user WHERE user_name=?");
             query_dup.bind(1, user_name);
             if (query_dup.executeStep())
                 return Result::USERNAME_DUPLICATE;
 
-            SQLite::Transaction tr(db);
             SQLite::Statement insert(db, "INSERT INTO user (user_name, password) VALUES (?, ?)");
             insert.bind(1, user_name);
             insert.bind(2, password);
             insert.exec();
-            tr.commit();
-        }
-
-        return Result::SUCCESS;
+            id = static_cast<int>(db.getLastInsertRowid());
+            return Result::SUCCESS;
+        }, [this, &user_name, &id] {
+            std::lock_guard<std::mutex> lock(session_mutex);
+            user_names[id] = { 0, user_name };
+        });
     }
 
-    unsigned generate_sessdata(const std::string& user_name) {
-        time_t t;
-        time(&t);
-        std::mt19937 mt_rand(std::random_device{}());
-        return (static_cast<unsigned int>(mt_rand() + std::hash<std::string>()(user_name)) << 16) + t;
+    // Random and not used by another session
+    unsigned generate_sessdata() {
+        std::lock_guard<std::mutex> lock(session_mutex);
+        unsigned sessdata;
+        do
+            sessdata = static_cast<unsigned>(sessdata_rand());
+        while (sessdata == 0 || sessions.count(sessdata));
+        return sessdata;
     }
 
     Result log_in(const std::string& user_name, const std::string& password, int& id, unsigned int& sessdata) {
@@ -94,18 +259,8 @@ public:
                 return Result::PASSWORD_INCORRECT;
         }
 
-        sessdata = generate_sessdata(user_name);
-        {
-            std::lock_guard<std::mutex> lock(db_mutex);
-            SQLite::Transaction tr(db);
-            SQLite::Statement insert(db, "UPDATE user SET sessdata=? WHERE id=?");
-            insert.bind(1, sessdata);
-            insert.bind(2, id);
-            insert.exec();
-            tr.commit();
-        };
-
-        return Result::SUCCESS;
+        sessdata = generate_sessdata();
+        return add_session(id, sessdata);
     }
 
     Result log_in(int id, const std::string& password, std::string& user_name, unsigned int& sessdata) {
@@ -123,133 +278,404 @@ public:
                 return Result::PASSWORD_INCORRECT;
         }
 
-        sessdata = generate_sessdata(user_name);
-        {
-            std::lock_guard<std::mutex> lock(db_mutex);
-            SQLite::Transaction tr(db);
-            SQLite::Statement insert(db, "UPDATE user SET sessdata=? WHERE id=?");
-            insert.bind(1, sessdata);
-            insert.bind(2, id);
-            insert.exec();
-            tr.commit();
-        };
-
-        return Result::SUCCESS;
+        sessdata = generate_sessdata();
+        return add_session(id, sessdata);
     }
 
+    // Ends this session only, the other devices of the user stay logged in
     Result log_out(unsigned int sessdata) {
         {
-            std::lock_guard<std::mutex> lock(db_mutex);
-            SQLite::Statement query_exist(db, "SELECT id FROM user WHERE sessdata=?");
-            query_exist.bind(1, sessdata);
-            if (!query_exist.executeStep())
+            std::lock_guard<std::mutex> lock(session_mutex);
+            if (!sessions.count(sessdata))
                 return Result::USER_DONOT_EXIST;
+        }
 
-            int id = query_exist.getColumn(0);
+        return write([this, sessdata] {
+            SQLite::Statement remove(db, "DELETE FROM session WHERE sessdata=?");
+            remove.bind(1, sessdata);
+            remove.exec();
+            return Result::SUCCESS;
+        }, [this, sessdata] {
+            std::lock_guard<std::mutex> lock(session_mutex);
+            drop_session(sessdata);
+        });
+    }
 
-            SQLite::Transaction tr(db);
-            SQLite::Statement insert(db, "UPDATE user SET sessdata=NULL WHERE id=?");
-            insert.bind(1, id);
-            insert.exec();
-            tr.commit();
+    // A signed token for the user that expires after lifetime seconds, "" if the user does not exist
+    std::string issue_token(int id, long long lifetime) {
+        SessionToken::Claims claims;
+        claims.id = id;
+        claims.expiry = static_cast<long long>(time(nullptr)) + lifetime;
+        {
+            std::lock_guard<std::mutex> lock(session_mutex);
+            auto it = user_names.find(id);
+            if (it == user_names.end())
+                return "";
+            claims.name_version = it->second.first;
         }
+        return tokens.sign(claims);
+    }
 
+    // Checks the signature, the expiry, the revocations and the name version, all in memory
+    Result authorize_token(const std::string& token, int& id, std::string& user_name) {
+        SessionToken::Claims claims;
+        if (!tokens.verify(token, claims))
+            return Result::SESSDATA_INVALID;
+
+        std::lock_guard<std::mutex> lock(session_mutex);
+        if (!revoked_tokens.empty() && revoked_tokens.count(SessionToken::signature(token)))
+            return Result::SESSDATA_INVALID;
+        auto it = user_names.find(claims.id);
+        if (it == user_names.end() || it->second.first != claims.name_version)
+            return Result::SESSDATA_INVALID;
+        id = claims.id;
+        user_name = it->second.second;
         return Result::SUCCESS;
     }
 
+    // The token stays revoked until it would have expired anyway
+    Result log_out_token(const std::string& token) {
+        SessionToken::Claims claims;
+        if (!tokens.verify(token, claims))
+            return Result::SESSDATA_INVALID;
+
+        auto signature = SessionToken::signature(token);
+        long long now = time(nullptr);
+        return write([this, &signature, &claims, now] {
+            SQLite::Statement q1(db, "INSERT OR IGNORE INTO revoked_token (signature, expiry) VALUES (?, ?)");
+            q1.bind(1, signature);
+            q1.bind(2, static_cast<int64_t>(claims.expiry));
+            q1.exec();
+            SQLite::Statement q2(db, "DELETE FROM revoked_token WHERE expiry<=?");
+            q2.bind(1, static_cast<int64_t>(now));
+            q2.exec();
+            return Result::SUCCESS;
+        }, [this, &signature, &claims, now] {
+            std::lock_guard<std::mutex> lock(session_mutex);
+            for (auto it = revoked_tokens.begin(); it != revoked_tokens.end();)
+                it = it->second <= now ? revoked_tokens.erase(it) : std::next(it);
+            revoked_tokens[signature] = claims.expiry;
+        });
+    }
+
+    // Only looks at sessions in memory, never waits for the database
+    bool find_session(unsigned int sessdata, int& id, std::string& user_name) {
+        std::lock_guard<std::mutex> lock(session_mutex);
+        auto it = sessions.find(sessdata);
+        if (it == sessions.end())
+            return false;
+        auto name = user_names.find(it->second.user_id);
+        if (name == user_names.end())
+            return false;
+        id = it->second.user_id;
+        user_name = name->second.second;
+        return true;
+    }
+
+    Json::Value get_session_stats() {
+        Json::Value res;
+        std::lock_guard<std::mutex> lock(session_mutex);
+        res["sessions"] = static_cast<Json::UInt64>(sessions.size());
+        res["users"] = static_cast<Json::UInt64>(sessions_of_user.size());
+        res["revoked_tokens"] = static_cast<Json::UInt64>(revoked_tokens.size());
+        return res;
+    }
+
+    // Every session is in memory, the session table is only read at startup
     Result authorize(const unsigned int& sessdata, int& id, std::string& user_name) {
+        return find_session(sessdata, id, user_name) ? Result::SUCCESS : Result::SESSDATA_INVALID;
+    }
+
+    // Queues a write, done is called on the writer thread once it is committed or has failed.
+    // apply runs inside a shared transaction under db_mutex and should only use the database.
+    void submit_write(std::function<Result()> apply, std::function<void(Result)> done) {
+        submit_write(std::move(apply), nullptr, std::move(done));
+    }
+
+    Json::Value get_write_stats() const {
+        Json::Value res;
+        res["batches"] = static_cast<Json::UInt64>(write_batches.load());
+        res["mutations"] = static_cast<Json::UInt64>(written_mutations.load());
+        res["peak_batch"] = static_cast<Json::UInt64>(peak_write_batch.load());
+        return res;
+    }
+
+private:
+    void submit_write(std::function<Result()> apply, std::function<void()> on_commit, std::function<void(Result)> done) {
         {
-            std::lock_guard<std::mutex> lock(db_mutex);
-            SQLite::Statement query_exist(db, "SELECT id, user_name FROM user WHERE sessdata=?");
-            query_exist.bind(1, sessdata);
-            if (!query_exist.executeStep())
-                return Result::SESSDATA_INVALID;
+            std::lock_guard<std::mutex> lock(mutation_mutex);
+            mutations.push_back({ std::move(apply), std::move(on_commit), std::move(done) });
+        }
+        mutation_cond.notify_one();
+    }
 
-            id = query_exist.getColumn(0);
-            std::string name = query_exist.getColumn(1);
-            user_name = name;
+    // Queues a write and waits until it is committed.
+    // on_commit is only called if apply succeeded and the batch was committed.
+    Result write(std::function<Result()> apply, std::function<void()> on_commit = nullptr) {
+        std::promise<Result> promise;
+        auto future = promise.get_future();
+        submit_write(std::move(apply), std::move(on_commit), [&promise](Result result) {
+            promise.set_value(result);
+        });
+        return future.get();
+    }
+
+    // A session for one more device, the oldest sessions of the user end beyond max_sessions_per_user.
+    // Which ones end is decided after the commit, when the sessions of the same batch are in memory,
+    // so two logins written together cannot both keep the oldest. Their rows are deleted by a later write
+    Result add_session(int id, unsigned int sessdata) {
+        long long expiry = static_cast<long long>(time(nullptr)) + session_lifetime;
+        return write([this, id, sessdata, expiry] {
+            SQLite::Statement insert(db, "INSERT INTO session (sessdata, user_id, expiry) VALUES (?, ?, ?)");
+            insert.bind(1, sessdata);
+            insert.bind(2, id);
+            insert.bind(3, static_cast<int64_t>(expiry));
+            insert.exec();
+            return Result::SUCCESS;
+        }, [this, id, sessdata, expiry] {
+            std::vector<unsigned int> evicted;
+            {
+                std::lock_guard<std::mutex> lock(session_mutex);
+                sessions[sessdata] = { id, expiry, 0 };
+                auto& current = sessions_of_user[id];
+                current.push_back(sessdata);
+                schedule_expiry(sessdata);
+                while (current.size() > max_sessions_per_user) {
+                    auto oldest = *std::min_element(current.begin(), current.end(), [this](unsigned a, unsigned b) {
+                        return sessions.at(a).expiry < sessions.at(b).expiry;
+                        });
+                    evicted.push_back(oldest);
+                    drop_session(oldest);
+                }
+            }
+            if (evicted.empty())
+                return;
+
+            submit_write([this, evicted] {
+                SQLite::Statement remove(db, "DELETE FROM session WHERE sessdata=?");
+                for (auto old : evicted) {
+                    remove.bind(1, old);
+                    remove.exec();
+                    remove.reset();
+                }
+                return Result::SUCCESS;
+            }, nullptr);
+        });
+    }
+
+    // Needs session_mutex. An expired session has no timer left to cancel.
+    void drop_session(unsigned int sessdata, bool expired = false) {
+        auto it = sessions.find(sessdata);
+        if (it == sessions.end())
+            return;
+        if (!expired)
+            timers.cancel(it->second.timer);
+        auto list = sessions_of_user.find(it->second.user_id);
+        if (list != sessions_of_user.end()) {
+            auto& ids = list->second;
+            ids.erase(std::remove(ids.begin(), ids.end(), sessdata), ids.end());
+            if (ids.empty())
+                sessions_of_user.erase(list);
         }
+        sessions.erase(it);
+    }
 
-        return Result::SUCCESS;
+    // Needs session_mutex
+    void schedule_expiry(unsigned int sessdata) {
+        auto& session = sessions[sessdata];
+        auto expiry = session.expiry;
+        auto delay = std::chrono::seconds(std::max(expiry - static_cast<long long>(time(nullptr)), 0LL));
+        session.timer = timers.schedule(delay, [this, sessdata, expiry] {
+            expire_session(sessdata, expiry);
+            });
+    }
+
+    // Runs on the timer thread. The writer puts the deletes of sessions that expire together in one batch
+    void expire_session(unsigned int sessdata, long long expiry) {
+        {
+            std::lock_guard<std::mutex> lock(session_mutex);
+            // The session may have been dropped, and the sessdata given out again, while the timer fired
+            auto it = sessions.find(sessdata);
+            if (it == sessions.end() || it->second.expiry != expiry)
+                return;
+            drop_session(sessdata, true);
+        }
+        submit_write([this, sessdata] {
+            SQLite::Statement remove(db, "DELETE FROM session WHERE sessdata=?");
+            remove.bind(1, sessdata);
+            remove.exec();
+            return Result::SUCCESS;
+        }, nullptr);
+    }
+
+    // The only thread that writes to users.db. Everything queued while the previous batch
+    // was being committed goes into one transaction, so a burst of writes costs one fsync.
+    void write_mutations() {
+        while (true) {
+            std::vector<Mutation> batch;
+            {
+                std::unique_lock<std::mutex> lock(mutation_mutex);
+                mutation_cond.wait(lock, [this] { return !mutations.empty(); });
+                batch.swap(mutations);
+            }
+
+            std::vector<Result> results(batch.size(), Result::FAILED);
+            {
+                std::lock_guard<std::mutex> lock(db_mutex);
+                bool committed = false;
+                try {
+                    SQLite::Transaction tr(db);
+                    for (size_t i = 0; i < batch.size(); ++i) {
+                        // A failed write is rolled back alone, the others are still committed
+                        db.exec("SAVEPOINT mutation");
+                        try {
+                            results[i] = batch[i].apply();
+                            db.exec("RELEASE mutation");
+                        }
+                        catch (const std::exception&) {
+                            db.exec("ROLLBACK TO mutation");
+                            db.exec("RELEASE mutation");
+                            results[i] = Result::FAILED;
+                        }
+                    }
+                    tr.commit();
+                    committed = true;
+                }
+                catch (const std::exception&) {
+                }
+
+                for (size_t i = 0; i < batch.size(); ++i) {
+                    if (!committed)
+                        results[i] = Result::FAILED;
+                    else if (results[i] == Result::SUCCESS && batch[i].on_commit)
+                        batch[i].on_commit();
+                }
+            }
+
+            ++write_batches;
+            written_mutations += batch.size();
+            auto peak = peak_write_batch.load();
+            while (batch.size() > peak && !peak_write_batch.compare_exchange_weak(peak, batch.size()));
+
+            for (size_t i = 0; i < batch.size(); ++i)
+                if (batch[i].done)
+                    batch[i].done(results[i]);
+        }
     }
 
+public:
+
     // Deprecated
     Result set_icon(int id, const std::string& icon = "") {
-        {
-            std::lock_guard<std::mutex> lock(db_mutex);
-            SQLite::Transaction tr(db);
+        return write([this, id, &icon] {
             SQLite::Statement modify(db, "UPDATE user SET icon=? WHERE id=?");
             modify.bind(1, icon);
             modify.bind(2, id);
             modify.exec();
-            tr.commit();
-        }
-
-        return Result::SUCCESS;
+            return Result::SUCCESS;
+        });
     }
 
-    Result set_icon_new(int id, const char* buffer, size_t len) {
-        std::ofstream fout("./icons/" + std::to_string(id) + ".png", std::ios::binary);
-        if (!fout)
+    // The icon is stored under the hash of its content, name receives the file name
+    Result set_icon_new(int id, IconUpload& upload, std::string& name) {
+        name = upload.commit();
+        if (name.empty())
             return Result::SET_ICON_FAILED;
-        fout.write(buffer, len);
-        fout.close();
+        auto result = write([this, id, &name] {
+            SQLite::Statement q1(db, "UPDATE user SET icon_hash=? WHERE id=?");
+            q1.bind(1, name.substr(0, name.find('.')));
+            q1.bind(2, id);
+            q1.exec();
+            return Result::SUCCESS;
+        }, [this, id] { invalidate_profile(id); });
+        return result == Result::SUCCESS ? Result::SUCCESS : Result::SET_ICON_FAILED;
+    }
+
+    // File name of the user's icon, empty if the user has not uploaded one
+    Result get_icon_name(int id, std::string& name) {
+        auto info = get_user_info(id);
+        if (info.isNull())
+            return Result::USER_DONOT_EXIST;
+        name = info["icon"].asString();
         return Result::SUCCESS;
     }
 
+    // Only looks at the profile cache, false if the user is not in it
+    bool get_cached_icon_name(int id, std::string& name) {
+        std::lock_guard<std::mutex> lock(profile_mutex);
+        auto it = profiles.find(id);
+        if (it == profiles.end())
+            return false;
+        name = it->second.icon;
+        return true;
+    }
+
     // Deprecated
     Result get_icon(int id, std::string& icon) {
-        {
-            std::lock_guard<std::mutex> lock(db_mutex);
+        std::lock_guard<std::mutex> lock(db_mutex);
+        try {
             SQLite::Statement query(db, "SELECT icon FROM user WHERE id=?");
             query.bind(1, id);
-            query.executeStep();
-            std::string ico = query.getColumn(0);
-            icon = ico;
+            return read_icon(query, icon);
+        }
+        catch (const std::exception&) {
+            return Result::FAILED;
         }
-
-        return Result::SUCCESS;
     }
 
     Result get_icon(const std::string& user_name, std::string& icon) {
-        {
-            std::lock_guard<std::mutex> lock(db_mutex);
+        std::lock_guard<std::mutex> lock(db_mutex);
+        try {
             SQLite::Statement query(db, "SELECT icon FROM user WHERE user_name=?");
             query.bind(1, user_name);
-            query.executeStep();
-            std::string ico = query.getColumn(0);
-            icon = ico;
+            return read_icon(query, icon);
+        }
+        catch (const std::exception&) {
+            return Result::FAILED;
         }
+    }
 
+private:
+    // Copies the icon column straight out of the row as bytes
+    static Result read_icon(SQLite::Statement& query, std::string& icon) {
+        if (!query.executeStep())
+            return Result::USER_DONOT_EXIST;
+        auto column = query.getColumn(0);
+        icon.clear();
+        if (column.getBytes() > 0)
+            icon.assign(static_cast<const char*>(column.getBlob()), column.getBytes());
         return Result::SUCCESS;
     }
 
+public:
+
     Result set_user_name(int id, const std::string& new_user_name) {
-        {
-            std::lock_guard<std::mutex> lock(db_mutex);
+        return write([this, id, &new_user_name] {
             SQLite::Statement query_dup(db, "SELECT * FROM user WHERE user_name=?");
             query_dup.bind(1, new_user_name);
             if (query_dup.executeStep())
                 return Result::USERNAME_DUPLICATE;
 
-            SQLite::Transaction tr(db);
-            SQLite::Statement modify(db, "UPDATE user SET user_name=? WHERE id=?");
+            SQLite::Statement modify(db, "UPDATE user SET user_name=?, name_version=name_version+1 WHERE id=?");
             modify.bind(1, new_user_name);
             modify.bind(2, id);
             modify.exec();
-            tr.commit();
-        }
-
-        return Result::SUCCESS;
+            return Result::SUCCESS;
+        }, [this, id, &new_user_name] {
+            invalidate_profile(id);
+            std::lock_guard<std::mutex> lock(session_mutex);
+            auto& name = user_names[id];
+            ++name.first;
+            name.second = new_user_name;
+        });
     }
 
     Result raise_friend_request(int requester_id, int requestee_id) {
         if (requester_id == requestee_id)
             return Result::CANNOT_REQUEST_SELF;
         
-        {
-            std::lock_guard<std::mutex> lock(db_mutex);
-
+        Json::Value event;
+        return write([this, requester_id, requestee_id, &event] {
             SQLite::Statement q1(db, "SELECT 1 FROM user WHERE id=?");
             q1.bind(1, requester_id);
             if (!q1.executeStep())
@@ -266,7 +692,6 @@ public:
             if (q3.executeStep())
                 return Result::ALREADY_FRIEND;
 
-            SQLite::Transaction tr(db);
             SQLite::Statement query(db, "INSERT INTO friend_request (requester_id, requestee_id) VALUES (?, ?)");
             query.bind(1, requester_id);
             query.bind(2, requestee_id);
@@ -276,232 +701,318 @@ public:
             catch (const std::exception&) {
                 return Result::ALREADY_REQUESTED;
             }
-            tr.commit();
-        }
-
-        return Result::SUCCESS;
+            event["message_type"] = "FRIEND_REQUEST";
+            event["user"] = query_for_user_info(requester_id);
+            return Result::SUCCESS;
+        }, [this, requester_id, requestee_id, &event] {
+            {
+                std::lock_guard<std::mutex> lock(request_mutex);
+                requesters[requestee_id].insert(requester_id);
+            }
+            events.publish(requestee_id, event);
+        });
     }
 
     Result get_friend_requests(int id, Json::Value& requests) {
-        {
-            std::lock_guard<std::mutex> lock(db_mutex);
-
-            SQLite::Statement q1(db, "SELECT requester_id FROM friend_request WHERE requestee_id=?");
-            q1.bind(1, id);
-            requests.resize(0);
-            
-            try {
-                while (q1.executeStep()) {
-                    int requester = q1.getColumn(0);
-                    requests.append(query_for_user_info(requester));
-                    //SQLite::Statement q2(db, "SELECT user_name FROM user WHERE id=?");
-                    //q2.bind(1, requester);
-                    //q2.executeStep();
-                    //std::string name = q2.getColumn(0);
-                    //Json::Value v;
-                    //v["name"] = name;
-                    //v["id"] = requester;
-                    //requests.append(v);
-                }
-            }
-            catch (const std::exception&) {
-                return Result::FAILED;
-            }
-        }
-
+        requests = get_user_infos(get_requesters(id));
         return Result::SUCCESS;
     }
 
     Result remove_friend_request(int id, int requester_id) {
-        {
-            std::lock_guard<std::mutex> lock(db_mutex);
+        return write([this, id, requester_id] {
+            delete_friend_requests(id, requester_id);
+            return Result::SUCCESS;
+        }, [this, id, requester_id] {
+            forget_friend_requests(id, requester_id);
+            // For the other devices of the user
+            Json::Value event;
+            event["message_type"] = "FRIEND_REQUEST_REMOVED";
+            event["user_id"] = requester_id;
+            events.publish(id, event);
+        });
+    }
 
-            SQLite::Statement q1(db, "DELETE FROM friend_request WHERE requester_id=? AND requestee_id=?");
+    // The requests are removed and the relation is added in the same transaction
+    Result accept_friend_request(int id, int requester_id) {
+        Json::Value to_requester, to_user;
+        return write([this, id, requester_id, &to_requester, &to_user] {
+            delete_friend_requests(id, requester_id);
+
+            SQLite::Statement q1(db, "INSERT INTO relation (user_id, friend_id) VALUES (?,?)");
+            q1.bind(1, id);
+            q1.bind(2, requester_id);
+            q1.executeStep();
+
+            q1.reset();
             q1.bind(1, requester_id);
             q1.bind(2, id);
+            q1.executeStep();
 
-            try {
-                SQLite::Transaction tr(db);
-                q1.executeStep();
-                q1.reset();
-                q1.bind(1, id);
-                q1.bind(2, requester_id);
-                q1.executeStep();
-                tr.commit();
-            }
-            catch (const std::exception&) {
-                return Result::FAILED;
-            }
-
+            // Each side learns about the other, the same entry as in the friend list
+            to_requester["message_type"] = to_user["message_type"] = "FRIEND_ADDED";
+            to_requester["friend"] = query_for_user_info(id);
+            to_requester["friend"]["unread"] = 0;
+            to_requester["friend"]["online"] = presence.is_online(id);
+            to_user["friend"] = query_for_user_info(requester_id);
+            to_user["friend"]["unread"] = 0;
+            to_user["friend"]["online"] = presence.is_online(requester_id);
             return Result::SUCCESS;
-        }
+        }, [this, id, requester_id, &to_requester, &to_user] {
+            forget_friend_requests(id, requester_id);
+            presence.add_friend(id, requester_id);
+            presence.add_friend(requester_id, id);
+            events.publish(requester_id, to_requester);
+            events.publish(id, to_user);
+        });
     }
 
-    Result accept_friend_request(int id, int requester_id) {
-        if (remove_friend_request(id, requester_id) == Result::FAILED)
-            return Result::FAILED;
+private:
+    // Both directions, run by the writer
+    void delete_friend_requests(int id, int requester_id) {
+        SQLite::Statement q1(db, "DELETE FROM friend_request WHERE requester_id=? AND requestee_id=?");
+        q1.bind(1, requester_id);
+        q1.bind(2, id);
+        q1.executeStep();
+        q1.reset();
+        q1.bind(1, id);
+        q1.bind(2, requester_id);
+        q1.executeStep();
+    }
+
+    // The same two directions in memory, on commit
+    void forget_friend_requests(int id, int requester_id) {
+        std::lock_guard<std::mutex> lock(request_mutex);
+        auto it = requesters.find(id);
+        if (it != requesters.end())
+            it->second.erase(requester_id);
+        it = requesters.find(requester_id);
+        if (it != requesters.end())
+            it->second.erase(id);
+    }
+
+    std::vector<int> get_requesters(int id) {
+        std::vector<int> res;
         {
-            try {
-                std::lock_guard<std::mutex> lock(db_mutex);
+            std::lock_guard<std::mutex> lock(request_mutex);
+            auto it = requesters.find(id);
+            if (it != requesters.end())
+                res.assign(it->second.begin(), it->second.end());
+        }
+        std::sort(res.begin(), res.end());
+        return res;
+    }
 
-                SQLite::Transaction tr(db);
-                SQLite::Statement q1(db, "INSERT INTO relation (user_id, friend_id) VALUES (?,?)");
-                q1.bind(1, id);
-                q1.bind(2, requester_id);
-                q1.executeStep();
-
-                q1.reset();
-                q1.bind(1, requester_id);
-                q1.bind(2, id);
-                q1.executeStep();
-                tr.commit();
-            }
-            catch (const std::exception&) {
-                return Result::FAILED;
-            }
+public:
+
+    // Built from memory: the friends from presence, the profiles from their cache and the
+    // unread counts from their table. Only profiles not cached yet are read from the database.
+    Json::Value get_friend_list(int id) {
+        auto friend_ids = presence.get_friends(id);
+        std::sort(friend_ids.begin(), friend_ids.end());
+        auto res = get_user_infos(friend_ids);
+        for (auto& f : res) {
+            f["unread"] = get_unread(id, f["id"].asInt());
+            f["online"] = presence.is_online(f["id"].asInt());
         }
+        return res;
+    }
 
-        return Result::SUCCESS;
+    // Friends with their unread counts and pending friend requests, as a client needs them
+    // when it starts
+    Json::Value get_friends_and_requests(int id) {
+        Json::Value res;
+        res["friends"] = get_friend_list(id);
+        res["friend_requests"] = get_user_infos(get_requesters(id));
+        return res;
     }
 
-    Json::Value get_friend_list(int id) {
+    Json::Value get_user_info(int id) {
+        {
+            std::lock_guard<std::mutex> lock(profile_mutex);
+            auto it = profiles.find(id);
+            if (it != profiles.end())
+                return profile_to_json(id, it->second);
+        }
+
         Json::Value res;
-        res.resize(0);
         {
             std::lock_guard<std::mutex> lock(db_mutex);
-            std::lock_guard<std::mutex> lock1(cache_mutex);
-            SQLite::Statement q1(db, "SELECT friend_id, unread FROM relation WHERE user_id=?");
-            q1.bind(1, id);
-            while (q1.executeStep()) {
-                int friend_id = q1.getColumn(0);
-                int unread = q1.getColumn(1);
-                auto [begin, end] = cache.equal_range(id);
-                for (auto it = begin; it != end; ++it)
-                    if (it->second.first == friend_id) {
-                        unread += it->second.second;
-                        break;
-                    }
-                auto f = query_for_user_info(friend_id);
-                f["unread"] = unread;
-                res.append(std::move(f));
-                //SQLite::Statement q2(db, "SELECT user_name, slogan FROM user WHERE id=?");
-                //q2.bind(1, friend_id);
-                //q2.executeStep();
-                //Json::Value f;
-                //f["name"] = q2.getColumn(0).getString();
-                //f["id"] = friend_id;
-                //f["slogan"] = q2.getColumn(1).getString();
-                //res.append(f);
-            }
+            res = query_for_user_info(id);
         }
         return res;
     }
 
-    Json::Value get_user_info(int id) {
+private:
+    // Profiles of the users in order, the ones not cached are read under one db_mutex hold.
+    // Users that do not exist are left out.
+    Json::Value get_user_infos(const std::vector<int>& ids) {
         Json::Value res;
-
+        res.resize(0);
+        std::vector<Json::Value> infos(ids.size());
+        std::vector<size_t> missing;
         {
+            std::lock_guard<std::mutex> lock(profile_mutex);
+            for (size_t i = 0; i < ids.size(); ++i) {
+                auto it = profiles.find(ids[i]);
+                if (it != profiles.end())
+                    infos[i] = profile_to_json(ids[i], it->second);
+                else
+                    missing.push_back(i);
+            }
+        }
+        if (!missing.empty()) {
             std::lock_guard<std::mutex> lock(db_mutex);
-            res = query_for_user_info(id);
+            for (auto i : missing) {
+                try {
+                    infos[i] = query_for_user_info(ids[i]);
+                }
+                catch (const std::exception&) {}
+            }
         }
+        for (auto& info : infos)
+            if (!info.isNull())
+                res.append(std::move(info));
         return res;
     }
 
-private:
+    // Needs db_mutex
     Json::Value query_for_user_info(int id) {
         Json::Value res;
-        SQLite::Statement q1(db, "SELECT user_name, slogan FROM user WHERE id=?");
+        SQLite::Statement q1(db, "SELECT id, user_name, slogan, icon_hash FROM user WHERE id=?");
         q1.bind(1, id);
-        if (q1.executeStep()) {
-            res["name"] = q1.getColumn(0).getString();
-            res["slogan"] = q1.getColumn(1).getString();
-            res["id"] = id;
-        }
+        if (q1.executeStep())
+            res = read_profile_row(q1);
+        return res;
+    }
+
+    // Row of (id, user_name, slogan, icon_hash), the profile is cached on the way
+    Json::Value read_profile_row(SQLite::Statement& q) {
+        int id = q.getColumn(0).getInt();
+        auto icon_hash = q.getColumn(3).getString();
+        UserProfile profile{ q.getColumn(1).getString(), q.getColumn(2).getString(), icon_hash.empty() ? "" : icon_hash + ".png" };
+        auto res = profile_to_json(id, profile);
+        std::lock_guard<std::mutex> lock(profile_mutex);
+        profiles[id] = std::move(profile);
+        return res;
+    }
+
+    static Json::Value profile_to_json(int id, const UserProfile& profile) {
+        Json::Value res;
+        res["name"] = profile.name;
+        res["slogan"] = profile.slogan;
+        res["icon"] = profile.icon;
+        res["id"] = id;
         return res;
     }
 
+    void invalidate_profile(int id) {
+        std::lock_guard<std::mutex> lock(profile_mutex);
+        profiles.erase(id);
+    }
+
 public:
     Result set_slogan(int id, const std::string& slogan) {
-        {
-            std::lock_guard<std::mutex> lock(db_mutex);
+        return write([this, id, &slogan] {
             SQLite::Statement q1(db, "UPDATE user SET slogan=? WHERE id=?");
             q1.bind(1, slogan);
             q1.bind(2, id);
-            SQLite::Transaction tr(db);
             q1.executeStep();
-            tr.commit();
-        }
-        return Result::SUCCESS;
+            return Result::SUCCESS;
+        }, [this, id] { invalidate_profile(id); });
     }
 
+    // Only counted between friends, the id comes from the client
     Result add_one_unread(int user_id, int friend_id) {
+        if (!presence.is_friend(user_id, friend_id))
+            return Result::FAILED;
+        int count;
         {
-            std::lock_guard<std::mutex> lock(cache_mutex);
-            auto [begin, end] = cache.equal_range(user_id);
-            bool found = false;
-            for (auto it = begin; it != end; ++it)
-                if (it->second.first == friend_id) {
-                    it->second.second++;
-                    found = true;
-                    break;
-                }
-            if (!found)
-                cache.emplace(user_id, std::pair{ friend_id, 1 });
+            std::lock_guard<std::mutex> lock(unread_mutex);
+            auto key = unread_key(user_id, friend_id);
+            count = ++unread[key];
+            unread_dirty.insert(key);
         }
-        //{
-        //    std::lock_guard<std::mutex> lock(db_mutex);
-        //    SQLite::Statement q1(db, "UPDATE relation SET unread=unread+1 WHERE user_id=? AND friend_id=?");
-        //    q1.bind(1, user_id);
-        //    q1.bind(2, friend_id);
-        //    SQLite::Transaction tr(db);
-        //    q1.executeStep();
-        //    tr.commit();
-        //}
+        unread_cond.notify_one();
+        publish_unread(user_id, friend_id, count);
         return Result::SUCCESS;
     }
 
     Result clear_unread(int user_id, int friend_id) {
         {
-            std::lock_guard<std::mutex> lock(cache_mutex);
-            auto [begin, end] = cache.equal_range(user_id);
-            for (auto it = begin; it != end; ++it)
-                if (it->second.first == friend_id) {
-                    it->second.second = 0;
-                    break;
-                }
-        }
-        {
-            std::lock_guard<std::mutex> lock(db_mutex);
-            SQLite::Statement q1(db, "UPDATE relation SET unread=0 WHERE user_id=? AND friend_id=?");
-            q1.bind(1, user_id);
-            q1.bind(2, friend_id);
-            SQLite::Transaction tr(db);
-            q1.executeStep();
-            tr.commit();
+            std::lock_guard<std::mutex> lock(unread_mutex);
+            auto key = unread_key(user_id, friend_id);
+            if (!unread.erase(key))
+                return Result::SUCCESS;
+            unread_dirty.insert(key);
         }
+        unread_cond.notify_one();
+        // The other devices of the user drop their badge too
+        publish_unread(user_id, friend_id, 0);
         return Result::SUCCESS;
     }
 
+    int get_unread(int user_id, int friend_id) {
+        std::lock_guard<std::mutex> lock(unread_mutex);
+        auto it = unread.find(unread_key(user_id, friend_id));
+        return it == unread.end() ? 0 : it->second;
+    }
+
 private:
-    void write_cache_to_database(){
+    void publish_unread(int user_id, int friend_id, int count) {
+        Json::Value event;
+        event["message_type"] = "UNREAD_COUNT";
+        event["friend_id"] = friend_id;
+        event["unread"] = count;
+        events.publish(user_id, event);
+    }
+
+    void write_unread_to_database() {
         while (true) {
-            std::this_thread::sleep_for(std::chrono::minutes(10));
-            std::lock_guard<std::mutex> lock(cache_mutex);
-            SQLite::Statement q1(db, "UPDATE relation SET unread=unread+? WHERE user_id=? AND friend_id=?");
-            SQLite::Transaction tr(db);
-            for (auto& item : cache) {
-                q1.bind(1, item.second.second);
-                q1.bind(2, item.first);
-                q1.bind(3, item.second.first);
-                try {
-                    q1.executeStep();
+            std::vector<std::tuple<int, int, int>> batch;
+            {
+                std::unique_lock<std::mutex> lock(unread_mutex);
+                unread_cond.wait(lock, [this] { return !unread_dirty.empty(); });
+                lock.unlock();
+                std::this_thread::sleep_for(unread_flush_delay);
+                lock.lock();
+
+                // The current values are written, so a counter changed many times is written once
+                batch.reserve(unread_dirty.size());
+                for (auto key : unread_dirty) {
+                    auto it = unread.find(key);
+                    batch.emplace_back(
+                        static_cast<int>(key >> 32),
+                        static_cast<int>(key & 0xffffffff),
+                        it == unread.end() ? 0 : it->second
+                    );
                 }
-                catch (const std::exception&) {
+                unread_dirty.clear();
+            }
+
+            // A counter with no relation row behind it is dropped, not kept and written again
+            std::vector<uint64_t> stale;
+            auto result = write([this, &batch, &stale] {
+                SQLite::Statement q1(db, "UPDATE relation SET unread=? WHERE user_id=? AND friend_id=?");
+                for (auto& [user_id, friend_id, count] : batch) {
+                    q1.bind(1, count);
+                    q1.bind(2, user_id);
+                    q1.bind(3, friend_id);
+                    if (q1.exec() == 0)
+                        stale.push_back(unread_key(user_id, friend_id));
+                    q1.reset();
                 }
-                q1.reset();
+                return Result::SUCCESS;
+            }, [this, &stale] {
+                std::lock_guard<std::mutex> lock(unread_mutex);
+                for (auto key : stale)
+                    unread.erase(key);
+            });
+            if (result != Result::SUCCESS) {
+                // Written again with the next batch
+                std::lock_guard<std::mutex> lock(unread_mutex);
+                for (auto& [user_id, friend_id, count] : batch)
+                    unread_dirty.insert(unread_key(user_id, friend_id));
             }
-            tr.commit();
-            cache.clear();
         }
     }
 };
@@ -2,33 +2,75 @@
 #define CHAT_HISTORY_HPP
 
 #include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <chrono>
 #include <string>
 #include <map>
+#include <set>
 #include <unordered_map>
 #include <memory>
 #include <thread>
 #include <functional>
+#include <algorithm>
 
 #include <sqlite3.h>
 #include <SQLiteCpp/SQLiteCpp.h>
 #include <json/json.h>
 
-struct ChatMessage {
-    int sender_id;
-    int receiver_id;
-    std::string message;
-    long long timestamp;
-};
+#include "ConversationCache.hpp"
 
 class ChatHistory {
     std::mutex db_mutex;
     SQLite::Database db{ "chat.db", SQLite::OPEN_READWRITE | SQLite::OPEN_CREATE };
 
+    // Messages waiting for the next group commit
     std::mutex cache_mutex;
+    std::condition_variable cache_cond;
     std::vector<ChatMessage> cache;
-    std::unordered_multimap<int, size_t> index;
+    // The batch being written, still visible to readers until it is committed
+    std::vector<ChatMessage> flushing;
+    // Latest messages of active conversations, also guarded by cache_mutex
+    ConversationCache hot{ 64, 32 << 20 };
+    // Who each user has chatted with, also guarded by cache_mutex
+    std::unordered_map<int, std::set<int>> partners;
+
+    std::atomic<long long> max_delay_ms{ 20 };
+    std::atomic<size_t> max_batch_size{ 256 };
+
+    // Between attempts to write a batch that failed
+    static constexpr std::chrono::milliseconds min_retry_delay{ 100 };
+    static constexpr std::chrono::milliseconds max_retry_delay{ 5000 };
+
+    // Metrics of the writer
+    std::atomic<unsigned long long> flush_count{ 0 };
+    std::atomic<unsigned long long> flushed_messages{ 0 };
+    std::atomic<unsigned long long> flush_failures{ 0 };
+    std::atomic<size_t> last_batch_size{ 0 };
+    std::atomic<size_t> peak_batch_size{ 0 };
+    std::atomic<long long> last_flush_us{ 0 };
+    std::atomic<long long> peak_flush_us{ 0 };
+    std::atomic<long long> total_flush_us{ 0 };
+    std::atomic<unsigned long long> db_reads{ 0 };
+
+    // Message ids are milliseconds since id_epoch_ms followed by a sequence number,
+    // so they are increasing, unique and still safe integers in JavaScript
+    static constexpr long long id_epoch_ms = 1704067200000;    // 2024-01-01
+    static constexpr int id_sequence_bits = 12;
+    std::atomic<long long> last_message_id{ 0 };
+
+    // How the message column of a row is stored
+    enum BodyFormat {
+        BODY_LEGACY = 0,        // JSON, the timestamp column has to be injected on read
+        BODY_WITHOUT_ID = 1,    // Compact JSON with the timestamp inside, but without the id
+        BODY_SPLICEABLE = 2,    // Compact JSON with the id and timestamp inside, sent as it is
+    };
 
     ChatHistory() {
+        upgrade_schema();
+        SQLite::Statement q1(db, "SELECT MAX(id) FROM chat");
+        if (q1.executeStep())
+            last_message_id = q1.getColumn(0).getInt64();
         std::thread t(std::bind(&ChatHistory::write_database, this));
         t.detach();
     }
@@ -51,126 +93,361 @@ public:
             );
     }
 
-    Result new_chat_message(int sender_id, int receiver_id, const std::string& message) {
+    // A message is written at most max_delay after it arrives,
+    // or as soon as max_batch_size messages are pending
+    void set_group_commit(std::chrono::milliseconds max_delay, size_t max_batch) {
+        max_delay_ms = max_delay.count();
+        max_batch_size = max_batch ? max_batch : 1;
+        cache_cond.notify_one();
+    }
+
+    // Keeps the latest messages_per_conversation messages of each active conversation,
+    // using at most about memory_budget bytes
+    void set_hot_cache(size_t messages_per_conversation, size_t memory_budget) {
+        std::lock_guard<std::mutex> lock(cache_mutex);
+        hot.configure(messages_per_conversation, memory_budget);
+    }
+
+    // Lock-free, ids from concurrent callers are still unique and increasing
+    long long next_message_id() {
+        auto now = std::chrono::duration_cast<std::chrono::milliseconds>(
+            std::chrono::system_clock::now().time_since_epoch()
+            ).count();
+        long long candidate = static_cast<long long>(now - id_epoch_ms) << id_sequence_bits;
+        long long last = last_message_id.load();
+        long long next;
+        do {
+            next = std::max(candidate, last + 1);
+        } while (!last_message_id.compare_exchange_weak(last, next));
+        return next;
+    }
+
+    // id should come from next_message_id.
+    // body should be compact JSON (no ending line feed) which already contains the id and timestamp,
+    // it is stored and later sent back without being parsed again
+    Result new_chat_message(long long id, int sender_id, int receiver_id, long long timestamp, const std::string& body) {
         {
             std::lock_guard<std::mutex> lock(cache_mutex);
-            cache.push_back({ sender_id, receiver_id, message, get_timestamp() });
-            index.emplace(sender_id, cache.size() - 1);
-            index.emplace(receiver_id, cache.size() - 1);
+            cache.push_back({ id, sender_id, receiver_id, body, timestamp });
+            hot.push(cache.back());
+            if (partners.count(sender_id))
+                partners[sender_id].insert(receiver_id);
+            if (partners.count(receiver_id))
+                partners[receiver_id].insert(sender_id);
         }
+        cache_cond.notify_one();
 
         return Result::SUCCESS;
     }
 
+    Json::Value get_stats() {
+        Json::Value res;
+        res["flush_count"] = static_cast<Json::UInt64>(flush_count);
+        res["flushed_messages"] = static_cast<Json::UInt64>(flushed_messages);
+        res["flush_failures"] = static_cast<Json::UInt64>(flush_failures);
+        res["last_batch_size"] = static_cast<Json::UInt64>(last_batch_size);
+        res["peak_batch_size"] = static_cast<Json::UInt64>(peak_batch_size);
+        res["last_flush_us"] = static_cast<Json::Int64>(last_flush_us);
+        res["peak_flush_us"] = static_cast<Json::Int64>(peak_flush_us);
+        res["db_reads"] = static_cast<Json::UInt64>(db_reads);
+        res["avg_flush_us"] = flush_count ?
+            static_cast<Json::Int64>(total_flush_us / static_cast<long long>(flush_count)) : 0;
+        {
+            std::lock_guard<std::mutex> lock(cache_mutex);
+            res["pending_messages"] = static_cast<Json::UInt64>(cache.size() + flushing.size());
+            res["hot_conversations"] = static_cast<Json::UInt64>(hot.get_size());
+            res["hot_bytes"] = static_cast<Json::UInt64>(hot.get_bytes());
+            res["hot_hits"] = static_cast<Json::UInt64>(hot.get_hits());
+            res["hot_misses"] = static_cast<Json::UInt64>(hot.get_misses());
+            res["hot_evictions"] = static_cast<Json::UInt64>(hot.get_evictions());
+        }
+        return res;
+    }
+
+private:
+    void upgrade_schema() {
+        bool has_body_format = false;
+        bool has_conversation = false;
+        {
+            SQLite::Statement q1(db, "PRAGMA table_info(chat)");
+            while (q1.executeStep()) {
+                auto column = q1.getColumn(1).getString();
+                if (column == "body_format")
+                    has_body_format = true;
+                else if (column == "conversation")
+                    has_conversation = true;
+            }
+        }
+        if (!has_body_format)
+            db.exec("ALTER TABLE chat ADD COLUMN body_format INTEGER DEFAULT 0");
+        if (!has_conversation) {
+            // Same value as ConversationCache::key
+            SQLite::Transaction tr(db);
+            db.exec("ALTER TABLE chat ADD COLUMN conversation INTEGER");
+            db.exec("UPDATE chat SET conversation=(MIN(sender_id, receiver_id) << 32) | MAX(sender_id, receiver_id)");
+            tr.commit();
+        }
+        db.exec("CREATE INDEX IF NOT EXISTS chat_conversation_id ON chat (conversation, id)");
+    }
+
     void write_database() {
+        // Ids are given by the server, so a message that is already there was written by an earlier
+        // attempt whose commit was reported as failed, and is skipped
+        SQLite::Statement q1(db, "INSERT OR IGNORE INTO chat (id, conversation, sender_id, receiver_id, timestamp, message, body_format) VALUES (?,?,?,?,?,?,?)");
+        auto backoff = min_retry_delay;
+
         while (true) {
-            std::this_thread::sleep_for(std::chrono::minutes(10));
+            {
+                std::unique_lock<std::mutex> lock(cache_mutex);
+                cache_cond.wait(lock, [this] { return !cache.empty(); });
 
-            std::lock_guard<std::mutex> lock(cache_mutex);
+                // Wait for more messages to join the batch, but never longer than max_delay
+                auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(max_delay_ms);
+                cache_cond.wait_until(lock, deadline, [this] { return cache.size() >= max_batch_size; });
 
-            SQLite::Statement q1(db, "INSERT INTO chat (sender_id, receiver_id, timestamp, message) VALUES (?,?,?,?)");
-            std::lock_guard<std::mutex> lock1(db_mutex);
-            SQLite::Transaction tr(db);
-            for (size_t i = 0; i < cache.size(); ++i) {
-                auto& item = cache[cache.size() - i - 1];
-                q1.bind(1, item.sender_id);
-                q1.bind(2, item.receiver_id);
-                q1.bind(3, static_cast<int64_t>(item.timestamp));
-                q1.bind(4, item.message);
+                if (cache.size() > max_batch_size) {
+                    flushing.assign(
+                        std::make_move_iterator(cache.begin()),
+                        std::make_move_iterator(cache.begin() + max_batch_size)
+                    );
+                    cache.erase(cache.begin(), cache.begin() + max_batch_size);
+                }
+                else
+                    flushing.swap(cache);
+            }
+
+            // flushing is only modified by this thread, so it can be read without cache_mutex
+            size_t batch_size = flushing.size();
+            auto start = std::chrono::steady_clock::now();
+            bool committed = false;
+            {
+                std::lock_guard<std::mutex> lock1(db_mutex);
                 try {
-                    q1.executeStep();
+                    SQLite::Transaction tr(db);
+                    for (auto& item : flushing) {
+                        q1.bind(1, static_cast<int64_t>(item.id));
+                        q1.bind(2, static_cast<int64_t>(ConversationCache::key(item.sender_id, item.receiver_id)));
+                        q1.bind(3, item.sender_id);
+                        q1.bind(4, item.receiver_id);
+                        q1.bind(5, static_cast<int64_t>(item.timestamp));
+                        q1.bind(6, item.message);
+                        q1.bind(7, BODY_SPLICEABLE);
+                        q1.executeStep();
+                        q1.reset();
+                    }
+                    tr.commit();
+                    committed = true;
                 }
                 catch (const std::exception&) {
+                    // Reset reports the error of the failed step again
+                    try {
+                        q1.reset();
+                    }
+                    catch (const std::exception&) {
+                    }
                 }
-                q1.reset();
+
+                // Still under db_mutex, so a reader never finds the batch both in the database
+                // and in flushing. A batch that was rolled back goes back to the head of the queue
+                std::lock_guard<std::mutex> lock2(cache_mutex);
+                if (!committed)
+                    cache.insert(
+                        cache.begin(),
+                        std::make_move_iterator(flushing.begin()),
+                        std::make_move_iterator(flushing.end())
+                    );
+                flushing.clear();
             }
-            tr.commit();
-            cache.clear();
-            index.clear();
+            auto elapsed = std::chrono::duration_cast<std::chrono::microseconds>(
+                std::chrono::steady_clock::now() - start
+                ).count();
+
+            // Written again after a delay that grows while it fails
+            if (!committed) {
+                ++flush_failures;
+                std::this_thread::sleep_for(backoff);
+                backoff = std::min(backoff * 2, max_retry_delay);
+                continue;
+            }
+            backoff = min_retry_delay;
+
+            ++flush_count;
+            flushed_messages += batch_size;
+            last_batch_size = batch_size;
+            if (batch_size > peak_batch_size)
+                peak_batch_size = batch_size;
+            last_flush_us = elapsed;
+            total_flush_us += elapsed;
+            if (elapsed > peak_flush_us)
+                peak_flush_us = elapsed;
         }
     }
 
-    Json::Value get_chat_message(int user_id, long long latest_timestamp) {
-        Json::Value res;
-        Json::Reader().parse("{}", res);
+    // Needs cache_mutex
+    template <typename Func>
+    void for_each_unflushed(Func func) {
+        for (auto& item : flushing)
+            func(item);
+        for (auto& item : cache)
+            func(item);
+    }
+
+    // Needs db_mutex, so that no message is moved from the cache to the database meanwhile
+    void load_conversation(int user_id, int friend_id) {
+        std::vector<ChatMessage> messages;
+        SQLite::Statement q1(db, "SELECT id, sender_id, receiver_id, timestamp, message, body_format FROM chat WHERE conversation=? ORDER BY id DESC LIMIT ?");
+        q1.bind(1, static_cast<int64_t>(ConversationCache::key(user_id, friend_id)));
+        q1.bind(2, static_cast<int64_t>(hot.get_capacity()));
+        while (q1.executeStep())
+            messages.push_back(read_row(q1));
+        bool complete = messages.size() < hot.get_capacity();
+        std::reverse(messages.begin(), messages.end());
+
+        std::lock_guard<std::mutex> lock(cache_mutex);
+        if (hot.contains(user_id, friend_id))
+            return;
+        for_each_unflushed([&](const ChatMessage& msg) {
+            if (ConversationCache::key(msg.sender_id, msg.receiver_id) == ConversationCache::key(user_id, friend_id))
+                messages.push_back(msg);
+        });
+        hot.insert(user_id, friend_id, messages, complete);
+    }
+
+    // Needs db_mutex
+    void load_partners(int user_id) {
+        std::set<int> ids;
+        SQLite::Statement q2(db, "SELECT DISTINCT receiver_id FROM chat WHERE sender_id=?");
+        q2.bind(1, user_id);
+        while (q2.executeStep())
+            ids.insert(q2.getColumn(0));
+        SQLite::Statement q3(db, "SELECT DISTINCT sender_id FROM chat WHERE receiver_id=?");
+        q3.bind(1, user_id);
+        while (q3.executeStep())
+            ids.insert(q3.getColumn(0));
 
-        // еļ¼ȫ
+        std::lock_guard<std::mutex> lock(cache_mutex);
+        if (partners.count(user_id))
+            return;
+        for_each_unflushed([&](const ChatMessage& msg) {
+            if (msg.sender_id == user_id)
+                ids.insert(msg.receiver_id);
+            else if (msg.receiver_id == user_id)
+                ids.insert(msg.sender_id);
+        });
+        partners.emplace(user_id, std::move(ids));
+    }
+
+    // The latest 20 messages before the cursor, latest first.
+    // Memory is tried first, then the conversation is loaded into memory,
+    // and only pages older than what is kept in memory are read from the database.
+    std::vector<ChatMessage> read_20_messages(int user_id, int friend_id, const ChatCursor& cursor) {
+        std::vector<ChatMessage> res;
         {
             std::lock_guard<std::mutex> lock(cache_mutex);
-            auto [begin, end] = index.equal_range(user_id);
-            for (auto it = begin; it != end; ++it)
-                if (cache[it->second].timestamp < latest_timestamp) {
-                    Json::Value item;
-                    Json::Reader().parse(cache[it->second].message, item);
-                    item["timestamp"] = static_cast<int64_t>(cache[it->second].timestamp);
-                    int friend_id = cache[it->second].sender_id == user_id ?
-                        cache[it->second].receiver_id : cache[it->second].sender_id;
-                    res[std::to_string(friend_id)].append(item);
-                }
+            if (hot.get(user_id, friend_id, cursor, 20, res))
+                return res;
         }
 
+        std::lock_guard<std::mutex> lock(db_mutex);
+        load_conversation(user_id, friend_id);
         {
-            std::lock_guard<std::mutex> lock(db_mutex);
-            std::set<int> ids;
-            SQLite::Statement q2(db, "SELECT DISTINCT receiver_id FROM chat WHERE sender_id=?");
-            q2.bind(1, user_id);
-            while (q2.executeStep())
-                ids.insert(q2.getColumn(0));
-            SQLite::Statement q3(db, "SELECT DISTINCT sender_id FROM chat WHERE receiver_id=?");
-            q3.bind(1, user_id);
-            while (q3.executeStep())
-                ids.insert(q3.getColumn(0));
-
-            for (auto& id : ids) {
-                SQLite::Statement q1(db, "SELECT sender_id, receiver_id, timestamp, message FROM chat WHERE ((sender_id=? AND receiver_id=?) OR (receiver_id=? AND sender_id=?)) AND timestamp<? ORDER BY timestamp DESC");
-                q1.bind(1, user_id);
-                q1.bind(2, id);
-                q1.bind(3, user_id);
-                q1.bind(4, id);
-                q1.bind(5, static_cast<int64_t>(latest_timestamp));
-                int cnt = 0;
-                while (q1.executeStep() && cnt < 20) {
-                    int sender_id = q1.getColumn(0);
-                    int receiver_id = q1.getColumn(1);
-                    long long timestamp = q1.getColumn(2).getInt64();
-                    std::string content = q1.getColumn(3);
-                    int friend_id = sender_id == user_id ? receiver_id : sender_id;
-                    Json::Value item;
-                    Json::Reader().parse(content, item);
-                    item["timestamp"] = static_cast<int64_t>(timestamp);
-                    res[std::to_string(friend_id)].append(item);
-                    ++cnt;
-                }
-            }
+            std::lock_guard<std::mutex> lock1(cache_mutex);
+            if (hot.get(user_id, friend_id, cursor, 20, res))
+                return res;
         }
+
+        ++db_reads;
+        // Walks the (conversation, id) index backwards from the cursor, so every page costs the same
+        SQLite::Statement q1(db, "SELECT id, sender_id, receiver_id, timestamp, message, body_format FROM chat WHERE conversation=? AND id<? AND timestamp<? ORDER BY id DESC LIMIT 20");
+        q1.bind(1, static_cast<int64_t>(ConversationCache::key(user_id, friend_id)));
+        q1.bind(2, static_cast<int64_t>(cursor.before_id));
+        q1.bind(3, static_cast<int64_t>(cursor.before_timestamp));
+        while (q1.executeStep())
+            res.push_back(read_row(q1));
+
+        // The ring drops the oldest messages of a conversation with more unwritten messages than it
+        // holds, and those are not in the database yet. An id can be in both after a commit that
+        // was reported as failed.
+        {
+            std::lock_guard<std::mutex> lock1(cache_mutex);
+            auto k = ConversationCache::key(user_id, friend_id);
+            for_each_unflushed([&](const ChatMessage& msg) {
+                if (ConversationCache::key(msg.sender_id, msg.receiver_id) == k && cursor.covers(msg)
+                    && std::none_of(res.begin(), res.end(), [&msg](const ChatMessage& m) { return m.id == msg.id; }))
+                    res.push_back(msg);
+            });
+        }
+        std::sort(res.begin(), res.end(), [](const ChatMessage& a, const ChatMessage& b) { return a.id > b.id; });
+        if (res.size() > 20)
+            res.resize(20);
         return res;
     }
 
-    Json::Value get_20_chat_messages(int user_id, int friend_id, long long latest_timestamp) {
-        Json::Value res;
-        res.resize(0);
+    // Row of (id, sender_id, receiver_id, timestamp, message, body_format).
+    // Older rows are converted once here, so every message in memory can be spliced.
+    static ChatMessage read_row(SQLite::Statement& q) {
+        ChatMessage msg{
+            q.getColumn(0).getInt64(), q.getColumn(1).getInt(), q.getColumn(2).getInt(),
+            q.getColumn(4).getString(), q.getColumn(3).getInt64()
+        };
+        if (q.getColumn(5).getInt() != BODY_SPLICEABLE) {
+            Json::Value item;
+            Json::Reader().parse(msg.message, item);
+            item["id"] = static_cast<int64_t>(msg.id);
+            item["timestamp"] = static_cast<int64_t>(msg.timestamp);
+            Json::FastWriter writer;
+            writer.omitEndingLineFeed();
+            msg.message = writer.write(item);
+        }
+        return msg;
+    }
+
+    static void append_array(std::string& out, const std::vector<ChatMessage>& messages) {
+        out.push_back('[');
+        for (size_t i = 0; i < messages.size(); ++i) {
+            if (i)
+                out.push_back(',');
+            out.append(messages[i].message);
+        }
+        out.push_back(']');
+    }
+
+public:
+    // The results are JSON texts spliced together from the stored message bodies
+    std::string get_chat_message(int user_id, const ChatCursor& cursor) {
+        std::string res = "{";
+
+        std::set<int> ids;
+        bool known;
         {
+            std::lock_guard<std::mutex> lock(cache_mutex);
+            known = partners.count(user_id);
+            if (known)
+                ids = partners[user_id];
+        }
+        if (!known) {
             std::lock_guard<std::mutex> lock(db_mutex);
+            load_partners(user_id);
+            std::lock_guard<std::mutex> lock1(cache_mutex);
+            ids = partners[user_id];
+        }
 
-            SQLite::Statement q1(db, "SELECT sender_id, receiver_id, timestamp, message FROM chat WHERE ((sender_id=? AND receiver_id=?) OR (receiver_id=? AND sender_id=?)) AND timestamp<? ORDER BY timestamp DESC");
-            q1.bind(1, user_id);
-            q1.bind(2, friend_id);
-            q1.bind(3, user_id);
-            q1.bind(4, friend_id);
-            q1.bind(5, static_cast<int64_t>(latest_timestamp));
-            int cnt = 0;
-            while (q1.executeStep() && cnt < 20) {
-                int sender_id = q1.getColumn(0);
-                int receiver_id = q1.getColumn(1);
-                long long timestamp = q1.getColumn(2).getInt64();
-                std::string content = q1.getColumn(3);
-                Json::Value item;
-                Json::Reader().parse(content, item);
-                item["timestamp"] = static_cast<int64_t>(timestamp);
-                res.append(item);
-                ++cnt;
-            }
+        for (auto& id : ids) {
+            auto messages = read_20_messages(user_id, id, cursor);
+            if (messages.empty())
+                continue;
+            if (res.size() > 1)
+                res.push_back(',');
+            res.append("\"" + std::to_string(id) + "\":");
+            append_array(res, messages);
         }
+        res.push_back('}');
+        return res;
+    }
+
+    std::string get_20_chat_messages(int user_id, int friend_id, const ChatCursor& cursor) {
+        std::string res;
+        append_array(res, read_20_messages(user_id, friend_id, cursor));
         return res;
     }
 };
@@ -0,0 +1,193 @@
+#ifndef CONVERSATION_CACHE_HPP
+#define CONVERSATION_CACHE_HPP
+
+#include <string>
+#include <vector>
+#include <list>
+#include <unordered_map>
+#include <cstdint>
+#include <algorithm>
+#include <limits>
+
+struct ChatMessage {
+    long long id;
+    int sender_id;
+    int receiver_id;
+    std::string message;
+    long long timestamp;
+};
+
+// Position in a conversation, messages before both bounds are older than the cursor
+struct ChatCursor {
+    long long before_id = std::numeric_limits<long long>::max();
+    long long before_timestamp = std::numeric_limits<long long>::max();
+
+    bool covers(const ChatMessage& msg) const {
+        return msg.id < before_id && msg.timestamp < before_timestamp;
+    }
+};
+
+// Keeps the latest messages of active conversations in memory.
+// Every conversation owns a fixed-size ring buffer, and whole conversations
+// are evicted in LRU order once the memory budget is exceeded.
+// Not thread-safe, the owner has to lock it.
+class ConversationCache {
+    struct Conversation {
+        std::vector<ChatMessage> ring;
+        size_t head = 0;            // Index of the oldest message
+        size_t count = 0;
+        size_t bytes = 0;
+        bool complete = false;      // There are no older messages in the database
+        std::list<uint64_t>::iterator lru_it;
+    };
+
+    size_t capacity;
+    size_t memory_budget;
+    size_t bytes = 0;
+
+    std::unordered_map<uint64_t, Conversation> conversations;
+    std::list<uint64_t> lru;        // Most recently used at the front
+
+    unsigned long long hits = 0;
+    unsigned long long misses = 0;
+    unsigned long long evictions = 0;
+
+public:
+    ConversationCache(size_t capacity, size_t memory_budget)
+        :capacity(capacity ? capacity : 1), memory_budget(memory_budget) {}
+
+    static uint64_t key(int user_a, int user_b) {
+        auto lo = static_cast<uint32_t>(std::min(user_a, user_b));
+        auto hi = static_cast<uint32_t>(std::max(user_a, user_b));
+        return (static_cast<uint64_t>(lo) << 32) | hi;
+    }
+
+    void configure(size_t new_capacity, size_t new_memory_budget) {
+        new_capacity = new_capacity ? new_capacity : 1;
+        if (new_capacity != capacity) {
+            conversations.clear();
+            lru.clear();
+            bytes = 0;
+        }
+        capacity = new_capacity;
+        memory_budget = new_memory_budget;
+        evict();
+    }
+
+    size_t get_capacity() const {
+        return capacity;
+    }
+
+    bool contains(int user_a, int user_b) const {
+        return conversations.count(key(user_a, user_b));
+    }
+
+    // Appends the message if its conversation is cached
+    void push(const ChatMessage& msg) {
+        auto k = key(msg.sender_id, msg.receiver_id);
+        auto it = conversations.find(k);
+        if (it == conversations.end())
+            return;
+        append(it->second, msg);
+        touch(it->second);
+        evict();
+    }
+
+    // messages should be ordered from the oldest to the latest
+    void insert(int user_a, int user_b, const std::vector<ChatMessage>& messages, bool complete) {
+        auto k = key(user_a, user_b);
+        auto [it, inserted] = conversations.try_emplace(k);
+        auto& conv = it->second;
+        if (inserted) {
+            lru.push_front(k);
+            conv.lru_it = lru.begin();
+        }
+        else {
+            bytes -= conv.bytes;
+            conv = Conversation{ {}, 0, 0, 0, false, conv.lru_it };
+        }
+        conv.ring.resize(capacity);
+        bytes += capacity * sizeof(ChatMessage);
+        conv.bytes = capacity * sizeof(ChatMessage);
+        conv.complete = complete;
+        for (auto& msg : messages)
+            append(conv, msg);
+        touch(conv);
+        evict();
+    }
+
+    // Collects at most limit messages older than the cursor, latest first.
+    // Returns false if the conversation is not cached or the cached part
+    // cannot fully answer the query.
+    bool get(int user_a, int user_b, const ChatCursor& cursor, size_t limit, std::vector<ChatMessage>& out) {
+        auto it = conversations.find(key(user_a, user_b));
+        if (it == conversations.end()) {
+            ++misses;
+            return false;
+        }
+        auto& conv = it->second;
+        touch(conv);
+
+        size_t found = 0;
+        for (size_t i = 0; i < conv.count && found < limit; ++i) {
+            auto& msg = conv.ring[(conv.head + conv.count - 1 - i) % capacity];
+            if (cursor.covers(msg)) {
+                out.push_back(msg);
+                ++found;
+            }
+        }
+        if (found < limit && !conv.complete) {
+            out.resize(out.size() - found);
+            ++misses;
+            return false;
+        }
+        ++hits;
+        return true;
+    }
+
+    unsigned long long get_hits() const { return hits; }
+    unsigned long long get_misses() const { return misses; }
+    unsigned long long get_evictions() const { return evictions; }
+    size_t get_bytes() const { return bytes; }
+    size_t get_size() const { return conversations.size(); }
+
+private:
+    static size_t message_bytes(const ChatMessage& msg) {
+        return msg.message.size();
+    }
+
+    void append(Conversation& conv, const ChatMessage& msg) {
+        size_t pos;
+        if (conv.count < capacity)
+            pos = (conv.head + conv.count++) % capacity;
+        else {
+            // The oldest message is dropped and is only left in the database
+            pos = conv.head;
+            conv.head = (conv.head + 1) % capacity;
+            conv.complete = false;
+        }
+        auto& slot = conv.ring[pos];
+        conv.bytes -= message_bytes(slot);
+        bytes -= message_bytes(slot);
+        slot = msg;
+        conv.bytes += message_bytes(slot);
+        bytes += message_bytes(slot);
+    }
+
+    void touch(Conversation& conv) {
+        lru.splice(lru.begin(), lru, conv.lru_it);
+    }
+
+    // Evicts the least recently used conversations, the latest used one is always kept
+    void evict() {
+        while (bytes > memory_budget && lru.size() > 1) {
+            auto k = lru.back();
+            bytes -= conversations[k].bytes;
+            conversations.erase(k);
+            lru.pop_back();
+            ++evictions;
+        }
+    }
+};
+
+#endif
@@ -0,0 +1,26 @@
+#ifndef COOKIE_HPP
+#define COOKIE_HPP
+
+#include <string>
+
+// Reads values out of a Cookie header, for the HTTP server and the WebSocket handshake alike
+class Cookie {
+public:
+    // The value of a cookie, "" if it is not set
+    static std::string get(const std::string& header, const std::string& name) {
+        size_t pos = 0;
+        while (pos < header.size()) {
+            while (pos < header.size() && header[pos] == ' ')
+                ++pos;
+            auto end = header.find(';', pos);
+            if (end == std::string::npos)
+                end = header.size();
+            if (header.compare(pos, name.size(), name) == 0 && pos + name.size() < end && header[pos + name.size()] == '=')
+                return header.substr(pos + name.size() + 1, end - pos - name.size() - 1);
+            pos = end + 1;
+        }
+        return "";
+    }
+};
+
+#endif
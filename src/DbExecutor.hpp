@@ -0,0 +1,172 @@
+#ifndef DB_EXECUTOR_HPP
+#define DB_EXECUTOR_HPP
+
+#include <deque>
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <future>
+#include <memory>
+#include <atomic>
+#include <chrono>
+#include <type_traits>
+#include <algorithm>
+
+#include <json/json.h>
+
+// Runs database work on its own threads, so the order in which queries run is decided
+// by their class and not by whichever thread wins db_mutex.
+// Heavy queries may only take some of the threads, the rest are always free for the others.
+// Writes to users.db are not run here, they queue for the Authorizer's writer thread.
+class DbExecutor {
+public:
+    // Lower values run first
+    enum class Priority {
+        NORMAL,     // Profiles, friends and other small queries
+        HEAVY,      // Chat history scans
+    };
+
+private:
+    static constexpr int priorities = 2;
+
+    struct Task {
+        std::function<void()> run;
+        std::chrono::steady_clock::time_point queued_at;
+    };
+
+    std::deque<Task> queues[priorities];
+    std::mutex mutex;
+    std::condition_variable cond;
+    std::vector<std::thread> workers;
+    unsigned max_heavy;
+    unsigned running_heavy = 0;
+    bool stopping = false;
+
+    std::atomic<unsigned long long> executed[priorities]{};
+    std::atomic<unsigned long long> total_wait_us[priorities]{};
+    std::atomic<unsigned long long> peak_wait_us[priorities]{};
+
+    DbExecutor(unsigned threads, unsigned max_heavy)
+        :max_heavy(std::max(1u, std::min(max_heavy, threads - 1))) {
+        for (unsigned i = 0; i < threads; ++i)
+            workers.emplace_back(&DbExecutor::work, this);
+    }
+
+public:
+    static DbExecutor& get_instance() {
+        static DbExecutor instance(4, 2);
+        return instance;
+    }
+
+    ~DbExecutor() {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stopping = true;
+        }
+        cond.notify_all();
+        for (auto& t : workers)
+            t.join();
+    }
+
+    // The result, or the exception thrown by task, is delivered through the future
+    template <typename F>
+    std::future<std::invoke_result_t<F>> submit(Priority priority, F task) {
+        auto packaged = std::make_shared<std::packaged_task<std::invoke_result_t<F>()>>(std::move(task));
+        auto future = packaged->get_future();
+        enqueue(priority, [packaged] { (*packaged)(); });
+        return future;
+    }
+
+    // done receives the result on the worker thread, task should not throw
+    template <typename F, typename Callback>
+    void post(Priority priority, F task, Callback done) {
+        enqueue(priority, [task = std::move(task), done = std::move(done)]() mutable {
+            done(task());
+        });
+    }
+
+    // Runs task and waits for it
+    template <typename F>
+    std::invoke_result_t<F> run(Priority priority, F task) {
+        return submit(priority, std::move(task)).get();
+    }
+
+    Json::Value get_stats() {
+        static const char* names[priorities] = { "normal", "heavy" };
+        Json::Value res;
+        std::lock_guard<std::mutex> lock(mutex);
+        for (int i = 0; i < priorities; ++i) {
+            auto& item = res[names[i]];
+            item["queued"] = static_cast<Json::UInt64>(queues[i].size());
+            item["executed"] = static_cast<Json::UInt64>(executed[i].load());
+            item["total_wait_us"] = static_cast<Json::UInt64>(total_wait_us[i].load());
+            item["peak_wait_us"] = static_cast<Json::UInt64>(peak_wait_us[i].load());
+        }
+        res["threads"] = static_cast<Json::UInt64>(workers.size());
+        res["max_heavy"] = max_heavy;
+        return res;
+    }
+
+private:
+    void enqueue(Priority priority, std::function<void()> run) {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            queues[static_cast<int>(priority)].push_back({ std::move(run), std::chrono::steady_clock::now() });
+        }
+        cond.notify_one();
+    }
+
+    // The first queue that may run now, or -1
+    int pick() {
+        for (int i = 0; i < priorities; ++i) {
+            if (queues[i].empty())
+                continue;
+            if (i == static_cast<int>(Priority::HEAVY) && running_heavy >= max_heavy)
+                continue;
+            return i;
+        }
+        return -1;
+    }
+
+    void work() {
+        while (true) {
+            Task task;
+            int priority;
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                cond.wait(lock, [this, &priority] {
+                    priority = pick();
+                    return stopping || priority != -1;
+                });
+                if (priority == -1)
+                    return;
+                task = std::move(queues[priority].front());
+                queues[priority].pop_front();
+                if (priority == static_cast<int>(Priority::HEAVY))
+                    ++running_heavy;
+            }
+
+            auto wait = std::chrono::duration_cast<std::chrono::microseconds>(
+                std::chrono::steady_clock::now() - task.queued_at).count();
+            ++executed[priority];
+            total_wait_us[priority] += wait;
+            auto peak = peak_wait_us[priority].load();
+            while (static_cast<unsigned long long>(wait) > peak && !peak_wait_us[priority].compare_exchange_weak(peak, wait));
+
+            task.run();
+
+            if (priority == static_cast<int>(Priority::HEAVY)) {
+                {
+                    std::lock_guard<std::mutex> lock(mutex);
+                    --running_heavy;
+                }
+                // A heavy task may be waiting for this slot
+                cond.notify_one();
+            }
+        }
+    }
+};
+
+#endif
@@ -0,0 +1,63 @@
+#ifndef EVENT_BUS_HPP
+#define EVENT_BUS_HPP
+
+#include <vector>
+#include <string>
+#include <functional>
+#include <mutex>
+#include <atomic>
+
+#include <json/json.h>
+
+// Carries events about a user from the code that changes something to whatever shows it
+// to that user, so Authorizer does not need to know about WebSocket connections.
+// Handlers run on the publishing thread, often with db_mutex held, and should only queue.
+class EventBus {
+public:
+    typedef std::function<void(int user_id, const std::string& payload)> Handler;
+
+private:
+    std::vector<Handler> handlers;
+    std::mutex mutex;
+    std::atomic<unsigned long long> published{ 0 };
+
+    EventBus() {}
+
+public:
+    static EventBus& get_instance() {
+        static EventBus instance;
+        return instance;
+    }
+
+    void subscribe(Handler handler) {
+        std::lock_guard<std::mutex> lock(mutex);
+        handlers.push_back(std::move(handler));
+    }
+
+    // The event is serialized once for all handlers
+    void publish(int user_id, const Json::Value& event) {
+        publish_many({ user_id }, event);
+    }
+
+    // The same event to many users, still serialized once
+    void publish_many(const std::vector<int>& user_ids, const Json::Value& event) {
+        published += user_ids.size();
+        Json::FastWriter writer;
+        writer.omitEndingLineFeed();
+        auto payload = writer.write(event);
+        std::lock_guard<std::mutex> lock(mutex);
+        for (auto& handler : handlers)
+            for (int user_id : user_ids)
+                handler(user_id, payload);
+    }
+
+    Json::Value get_stats() {
+        Json::Value res;
+        res["published"] = static_cast<Json::UInt64>(published.load());
+        std::lock_guard<std::mutex> lock(mutex);
+        res["handlers"] = static_cast<Json::UInt64>(handlers.size());
+        return res;
+    }
+};
+
+#endif
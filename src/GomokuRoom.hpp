@@ -25,6 +25,15 @@ public:
         return "GOMOKU";
     }
 
+    virtual int get_max_players() {
+        return 2;
+    }
+
+    virtual void recycle() {
+        Room<SendMsgFunc>::recycle();
+        game.clear();
+    }
+
     virtual void process_message(
         unsigned conn_id,
         const std::string& user_name,
@@ -48,7 +57,7 @@ public:
                         send_game_info();
                         auto status = game.get_status();
                         if (status != Gomoku::NOT_END) {
-                            this->is_game_on = false;
+                            this->end_game_elsewhere();
                             send_game_result(status == Gomoku::BLACK_WIN, status == Gomoku::TIED);
                         }
                     }
@@ -3,6 +3,10 @@
 
 #include <vector>
 #include <string>
+#include <functional>
+#include <regex>
+#include <memory>
+#include <mutex>
 
 #include <json/json.h>
 #include <httplib.h>
@@ -10,58 +14,89 @@
 
 #include "Authorizer.hpp"
 #include "ChatHistory.hpp"
+#include "DbExecutor.hpp"
+#include "IconCache.hpp"
+#include "ResponseCompressor.hpp"
+#include "Cookie.hpp"
+#include "EventBus.hpp"
+#include "Presence.hpp"
+#include "Timers.hpp"
 
 typedef websocketpp::log::basic<websocketpp::concurrency::basic, websocketpp::log::elevel> basic_elog;
 
 class HttpServer {
     Authorizer& auth = Authorizer::get_instance();
     ChatHistory& chat_history = ChatHistory::get_instance();
+    // Database work is run there, handler threads only wait for it
+    DbExecutor& db = DbExecutor::get_instance();
 
     httplib::Server server;
 
     basic_elog elog;
 
-    static constexpr int cookie_max_age = 1296000;
+    IconCache icons{ "./icons", 64 << 20 };
+    // Icons stored in the database by the deprecated API, keyed by user id
+    IconCache legacy_icons{ "", 16 << 20 };
+    // For the responses that grow with the number of friends and messages
+    ResponseCompressor compressor;
+
+    static constexpr int cookie_max_age = Authorizer::session_lifetime;
+    // Icons requested by user id can be replaced, so clients revalidate them after a while
+    static constexpr int icon_max_age = 60;
+    // Uploads are aborted as soon as they exceed this size
+    static constexpr size_t icon_max_size = 4 << 20;
+    // Chromium caps it at 2 hours, Firefox at 24 hours
+    static constexpr int preflight_max_age = 86400;
+    static constexpr size_t http_threads = 64;
+
+    // Runs the requests that come through handle_http, so the WebSocket server's threads do not
+    // wait for the database. Started by the first of them, a server on its own port has none.
+    std::unique_ptr<httplib::ThreadPool> handle_http_threads;
+    std::once_flag handle_http_threads_started;
 
 public:
-    HttpServer() {
-        srand(time(0));
-        elog.set_channels(websocketpp::log::elevel::info);
-
-        server.Get("/hello", [this](const httplib::Request& req, httplib::Response& res) {
-            res.set_header("Access-Control-Allow-Origin", req.get_header_value("Origin"));
-            res.set_header("Access-Control-Allow-Credentials", "true");
+    // Largest request body accepted when serving through handle_http, which buffers the body
+    static constexpr size_t max_body_size = icon_max_size + (64 << 10);
 
-            bool failed;
-            auto sessdata = parse_cookie(req.get_header_value("Cookie"), failed);
-            if (failed) {
-                res.set_content("PLEASE_LOG_IN", "text/plain");
-                return;
-            }
+private:
 
-            Authorizer::Result result;
-            int id; std::string user_name;
-            result = auth.authorize(sessdata, id, user_name);
+    // Routes are also kept here, so requests that do not come through httplib can be dispatched
+    struct Route {
+        std::string method;
+        std::regex pattern;
+        httplib::Server::Handler handler;
+        httplib::Server::HandlerWithContentReader handler_with_content_reader;
+    };
+    std::vector<Route> routes;
 
-            if (result == Authorizer::Result::SUCCESS) {
-                res.set_content("Hello, #" + std::to_string(id) + " " + user_name + "!", "text/plain");
-            }
-            else {
-                res.set_content("PLEASE_LOG_IN", "text/plain");
-            }
-
-            }
-        );
+    // Handlers of the routes that need a logged-in user, which is passed to them as id and user_name
+    using SessionHandler = std::function<void(const httplib::Request&, httplib::Response&, int, const std::string&)>;
+    using SessionHandlerWithContentReader = std::function<void(const httplib::Request&, httplib::Response&, int, const std::string&,
+        const httplib::ContentReader&)>;
 
+public:
+    HttpServer() {
+        srand(time(0));
+        elog.set_channels(websocketpp::log::elevel::info);
 
-        server.Options("/login", [](const httplib::Request& req, httplib::Response& res) {
-            res.set_header("Access-Control-Allow-Origin", req.get_header_value("Origin"));
-            res.set_header("Access-Control-Allow-Credentials", "true");
-            res.set_header("Access-Control-Allow-Headers", "Content-Type");
-            }
+        // Headers and body are written separately, without TCP_NODELAY the body
+        // waits for the delayed ACK. Clients also fetch many icons in a row on one connection.
+        server.set_tcp_nodelay(true);
+        server.set_keep_alive_max_count(100);
+        // Handler threads mostly wait for the DbExecutor, which bounds the database work.
+        // With few of them, slow history requests would hold every thread and queue a log in behind them.
+        server.new_task_queue = [] { return new httplib::ThreadPool(http_threads); };
+
+        server.set_pre_routing_handler([this](const httplib::Request& req, httplib::Response& res) {
+            return pre_route(req, res);
+            });
+
+        Get("/hello", with_session([this](const httplib::Request&, httplib::Response& res, int id, const std::string& user_name) {
+            res.set_content("Hello, #" + std::to_string(id) + " " + user_name + "!", "text/plain");
+            })
         );
 
-        server.Post("/login", [this](const httplib::Request& req, httplib::Response& res) {
+        Post("/login", [this](const httplib::Request& req, httplib::Response& res) {
             Json::Reader reader;
             Json::Value payload;
             reader.parse(req.body, payload);
@@ -77,6 +112,7 @@ public:
                 res.set_header("Set-Cookie", "sessdata=" + std::to_string(sessdata) + "; Max-Age=" + std::to_string(cookie_max_age));
                 res.set_header("Set-Cookie", "user_name=" + user_name + "; Max-Age=" + std::to_string(cookie_max_age));
                 res.set_header("Set-Cookie", "id=" + std::to_string(id) + "; Max-Age=" + std::to_string(cookie_max_age));
+                res.set_header("Set-Cookie", "token=" + auth.issue_token(id, cookie_max_age) + "; Max-Age=" + std::to_string(cookie_max_age));
                 res.set_content("SUCCESS", "text/plain");
                 elog.write(websocketpp::log::elevel::info, "User '" + user_name + "'(#" + std::to_string(id) + ") logged in.");
             }
@@ -87,12 +123,10 @@ public:
                 res.set_content("USER_DONOT_EXIST", "text/plain");
             }
 
-            res.set_header("Access-Control-Allow-Origin", req.get_header_value("Origin"));
-            res.set_header("Access-Control-Allow-Credentials", "true");
             }
         );
 
-        server.Post("/login-byid", [this](const httplib::Request& req, httplib::Response& res) {
+        Post("/login-byid", [this](const httplib::Request& req, httplib::Response& res) {
             Json::Reader reader;
             Json::Value payload;
             reader.parse(req.body, payload);
@@ -108,6 +142,7 @@ public:
                 res.set_header("Set-Cookie", "sessdata=" + std::to_string(sessdata) + "; Max-Age=" + std::to_string(cookie_max_age));
                 res.set_header("Set-Cookie", "user_name=" + user_name + "; Max-Age=" + std::to_string(cookie_max_age));
                 res.set_header("Set-Cookie", "id=" + std::to_string(id) + "; Max-Age=" + std::to_string(cookie_max_age));
+                res.set_header("Set-Cookie", "token=" + auth.issue_token(id, cookie_max_age) + "; Max-Age=" + std::to_string(cookie_max_age));
                 res.set_content("SUCCESS", "text/plain");
                 elog.write(websocketpp::log::elevel::info, "User '" + user_name + "'(#" + std::to_string(id) + ") logged in.");
             }
@@ -118,33 +153,27 @@ public:
                 res.set_content("USER_DONOT_EXIST", "text/plain");
             }
 
-            res.set_header("Access-Control-Allow-Origin", req.get_header_value("Origin"));
-            res.set_header("Access-Control-Allow-Credentials", "true");
             }
         );
 
-        server.Options("/login-byid", [](const httplib::Request& req, httplib::Response& res) {
-            res.set_header("Access-Control-Allow-Origin", req.get_header_value("Origin"));
-            res.set_header("Access-Control-Allow-Credentials", "true");
-            res.set_header("Access-Control-Allow-Headers", "Content-Type");
-            }
-        );
-
-        server.Get("/logout", [this](const httplib::Request& req, httplib::Response& res) {
-            res.set_header("Access-Control-Allow-Origin", req.get_header_value("Origin"));
-            res.set_header("Access-Control-Allow-Credentials", "true");
-
+        Get("/logout", [this](const httplib::Request& req, httplib::Response& res) {
+            auto cookie = req.get_header_value("Cookie");
+            auto token = Cookie::get(cookie, "token");
             bool failed;
-            auto sessdata = parse_cookie(req.get_header_value("Cookie"), failed);
-            if (failed) {
+            auto sessdata = parse_cookie(cookie, failed);
+            if (failed && token.empty()) {
                 res.set_content("PLEASE_LOG_IN", "text/plain");
                 return;
             }
 
-            Authorizer::Result result;
-            result = auth.log_out(sessdata);
+            // Both are ended, a client may hold a token and the sessdata of the same login
+            bool logged_out = false;
+            if (!token.empty())
+                logged_out = auth.log_out_token(token) == Authorizer::Result::SUCCESS;
+            if (!failed)
+                logged_out = auth.log_out(sessdata) == Authorizer::Result::SUCCESS || logged_out;
 
-            if (result == Authorizer::Result::SUCCESS) {
+            if (logged_out) {
                 res.set_content("Successfully logged out.", "text/plain");
             }
             else {
@@ -154,14 +183,7 @@ public:
             }
         );
 
-        server.Options("/register", [](const httplib::Request& req, httplib::Response& res) {
-            res.set_header("Access-Control-Allow-Origin", req.get_header_value("Origin"));
-            res.set_header("Access-Control-Allow-Credentials", "true");
-            res.set_header("Access-Control-Allow-Headers", "Content-Type");
-            }
-        );
-
-        server.Post("/register", [this](const httplib::Request& req, httplib::Response& res) {
+        Post("/register", [this](const httplib::Request& req, httplib::Response& res) {
             Json::Reader reader;
             Json::Value payload;
             reader.parse(req.body, payload);
@@ -183,406 +205,482 @@ public:
                 res.set_content("FAILED", "text/plain");
             }
 
-            res.set_header("Access-Control-Allow-Origin", req.get_header_value("Origin"));
-            res.set_header("Access-Control-Allow-Credentials", "true");
-            }
-        );
-
-        server.Options("/upload-icon", [](const httplib::Request& req, httplib::Response& res) {
-            res.set_header("Access-Control-Allow-Origin", req.get_header_value("Origin"));
-            res.set_header("Access-Control-Allow-Credentials", "true");
-            res.set_header("Access-Control-Allow-Headers", "Content-Type, x-requested-with");
             }
         );
 
-        server.Post("/upload-icon", [this](const httplib::Request& req, httplib::Response& res) {
-            res.set_header("Access-Control-Allow-Origin", req.get_header_value("Origin"));
-            res.set_header("Access-Control-Allow-Credentials", "true");
-
-            bool failed;
-            auto sessdata = parse_cookie(req.get_header_value("Cookie"), failed);
-            if (failed) {
-                res.set_content("PLEASE_LOG_IN", "text/plain");
+        // The icon is streamed into a temporary file instead of being buffered in memory
+        Post("/upload-icon", with_session([this](const httplib::Request& req, httplib::Response& res, int id, const std::string& user_name,
+            const httplib::ContentReader& content_reader) {
+            if (!req.is_multipart_form_data()) {
+                res.set_content("FAILED", "text/plain");
                 return;
             }
 
-            Authorizer::Result result;
-            int id; std::string user_name;
-            result = auth.authorize(sessdata, id, user_name);
-
-            if (result == Authorizer::Result::SUCCESS) {
-                result = auth.set_icon_new(id, req.files.begin()->second.content.data(), req.files.begin()->second.content.length() - 1);
-                if (result == Authorizer::Result::SUCCESS) {
-                    res.set_content("SUCCESS", "text/plain");
-                    elog.write(websocketpp::log::elevel::info, "User '" + user_name + "'(#" + std::to_string(id) + ") uploaded a new icon.");
+            IconUpload upload("./icons", icon_max_size);
+            // Only the first part with a file name is taken, other fields are skipped
+            int files = 0;
+            bool taking = false;
+            bool received = content_reader(
+                [&files, &taking](const httplib::MultipartFormData& part) {
+                    taking = !part.filename.empty() && ++files == 1;
+                    return true;
+                },
+                [&taking, &upload](const char* data, size_t len) {
+                    return !taking || upload.write(data, len);
                 }
-                else
-                    res.set_content("FAILED", "text/plain");
+            );
+
+            if (upload.is_too_large()) {
+                res.set_content("ICON_TOO_LARGE", "text/plain");
+                return;
             }
-            else {
-                res.set_content("PLEASE_LOG_IN", "text/plain");
+            if (!received || files == 0) {
+                res.set_content("FAILED", "text/plain");
+                return;
             }
 
+            // Keeps the old behaviour, which stored the file without its last byte
+            upload.drop_tail(1);
+            std::string icon_name;
+            auto result = auth.set_icon_new(id, upload, icon_name);
+            if (result == Authorizer::Result::SUCCESS) {
+                res.set_content("SUCCESS", "text/plain");
+                elog.write(websocketpp::log::elevel::info, "User '" + user_name + "'(#" + std::to_string(id) + ") uploaded a new icon " + icon_name + ".");
             }
+            else
+                res.set_content("FAILED", "text/plain");
+            })
         );
 
-        server.Get("/icon", [this](const httplib::Request& req, httplib::Response& res) {
-            auto icon = new std::string;
+        // Deprecated
+        Get("/icon", [this](const httplib::Request& req, httplib::Response& res) {
+            std::shared_ptr<const IconCache::Icon> icon;
 
             auto it = req.params.find("id");
             if (it != req.params.end()) {
-                int id = std::atoi(req.params.find("id")->second.c_str());
-                auth.get_icon(id, *icon);
+                int id = std::atoi(it->second.c_str());
+                icon = legacy_icons.get(std::to_string(id), [this, id]() -> std::shared_ptr<IconCache::Icon> {
+                    std::string content;
+                    if (db.run(DbExecutor::Priority::NORMAL, [&] { return auth.get_icon(id, content); }) != Authorizer::Result::SUCCESS || content.empty())
+                        return nullptr;
+                    return IconCache::make_icon(std::move(content));
+                });
             }
 
             else if ((it = req.params.find("user_name")) != req.params.end()) {
-                std::string user_name = req.params.find("user_name")->second;
-                auth.get_icon(user_name, *icon);
-            }
-
-            if (!icon->empty())
-                res.set_content_provider(
-                    icon->size(),
-                    "multipart/form-data",
-                    [icon](size_t offset, size_t len, httplib::DataSink& sink) {
-                        sink.write(&(*icon)[offset], len > 4 ? 4 : len);
-                        return true;
-                    },
-                    [icon](bool) { delete icon; }
-            );
-
-            else delete icon;
-
-            res.set_header("Access-Control-Allow-Origin", req.get_header_value("Origin"));
-            res.set_header("Access-Control-Allow-Credentials", "true");
-
+                std::string content;
+                if (db.run(DbExecutor::Priority::NORMAL, [&] { return auth.get_icon(it->second, content); }) == Authorizer::Result::SUCCESS && !content.empty())
+                    icon = IconCache::make_icon(std::move(content));
             }
-        );
-
-        server.set_mount_point("/user-icon/", "./icons");
 
-        server.Options("/set-name", [](const httplib::Request& req, httplib::Response& res) {
-            res.set_header("Access-Control-Allow-Origin", req.get_header_value("Origin"));
-            res.set_header("Access-Control-Allow-Credentials", "true");
-            res.set_header("Access-Control-Allow-Headers", "Content-Type, x-requested-with");
-            }
-        );
-
-        server.Post("/set-name", [this](const httplib::Request& req, httplib::Response& res) {
-            res.set_header("Access-Control-Allow-Origin", req.get_header_value("Origin"));
-            res.set_header("Access-Control-Allow-Credentials", "true");
+            if (!icon)
+                return;
 
-            bool failed;
-            auto sessdata = parse_cookie(req.get_header_value("Cookie"), failed);
-            if (failed) {
-                res.set_content("PLEASE_LOG_IN", "text/plain");
+            res.set_header("ETag", icon->etag);
+            res.set_header("Cache-Control", "public, max-age=" + std::to_string(icon_max_age));
+            if (IconCache::not_modified(*icon, req.get_header_value("If-None-Match"), req.get_header_value("If-Modified-Since"))) {
+                res.status = 304;
                 return;
             }
 
-            Authorizer::Result result;
-            int id; std::string user_name;
-            result = auth.authorize(sessdata, id, user_name);
-
-            if (result == Authorizer::Result::SUCCESS) {
-                Json::Value reqbody;
-                Json::Reader reader;
-                reader.parse(req.body, reqbody);
-                result = auth.set_user_name(id, reqbody["user_name"].asString());
-                if (result == Authorizer::Result::SUCCESS) {
-                    res.set_content("SUCCESS", "text/plain");
-                    res.set_header("Set-Cookie", "user_name=" + reqbody["user_name"].asString()
-                        + "; Max-Age=" + std::to_string(cookie_max_age));
-                    elog.write(websocketpp::log::elevel::info, "User '" + user_name + "'(#" + std::to_string(id)
-                        + ") changed name to '" + reqbody["user_name"].asString() + "'.");
+            res.set_content_provider(
+                icon->content.size(),
+                "multipart/form-data",
+                [icon](size_t offset, size_t len, httplib::DataSink& sink) {
+                    sink.write(icon->content.data() + offset, len);
+                    return true;
                 }
-                else if (result == Authorizer::Result::USERNAME_DUPLICATE)
-                    res.set_content("USERNAME_DUPLICATE", "text/plain");
-                else
-                    res.set_content("FAILED", "text/plain");
-            }
-            else {
-                res.set_content("PLEASE_LOG_IN", "text/plain");
-            }
+            );
 
             }
         );
 
-        server.Options("/friend-request", [](const httplib::Request& req, httplib::Response& res) {
-            res.set_header("Access-Control-Allow-Origin", req.get_header_value("Origin"));
-            res.set_header("Access-Control-Allow-Credentials", "true");
-            res.set_header("Access-Control-Allow-Headers", "Content-Type, x-requested-with");
+        Get(R"(/user-icon/([\w-]+\.png))", [this](const httplib::Request& req, httplib::Response& res) {
+            // Icons named after their content never change. <id>.png is kept for old clients,
+            // it refers to whatever icon the user has now.
+            std::string name = req.matches[1];
+            bool immutable = is_content_name(name);
+            if (!immutable) {
+                int id = std::atoi(name.c_str());
+                std::string icon_name;
+                // The profile cache answers most of them, the executor is only waited for on a miss
+                if (std::to_string(id) + ".png" == name
+                    && (auth.get_cached_icon_name(id, icon_name)
+                        || db.run(DbExecutor::Priority::NORMAL, [&] { return auth.get_icon_name(id, icon_name); }) == Authorizer::Result::SUCCESS)
+                    && !icon_name.empty())
+                    name = icon_name;
+            }
+
+            auto icon = icons.get(name);
+            if (!icon) {
+                res.status = 404;
+                return;
             }
-        );
-
-        server.Post("/friend-request", [this](const httplib::Request& req, httplib::Response& res) {
-            res.set_header("Access-Control-Allow-Origin", req.get_header_value("Origin"));
-            res.set_header("Access-Control-Allow-Credentials", "true");
 
-            bool failed;
-            auto sessdata = parse_cookie(req.get_header_value("Cookie"), failed);
-            if (failed) {
-                res.set_content("PLEASE_LOG_IN", "text/plain");
+            res.set_header("ETag", icon->etag);
+            res.set_header("Last-Modified", icon->last_modified);
+            if (immutable)
+                res.set_header("Cache-Control", "public, max-age=31536000, immutable");
+            else
+                res.set_header("Cache-Control", "public, max-age=" + std::to_string(icon_max_age));
+            if (IconCache::not_modified(*icon, req.get_header_value("If-None-Match"), req.get_header_value("If-Modified-Since"))) {
+                res.status = 304;
                 return;
             }
 
-            Authorizer::Result result;
-            int id; std::string user_name;
-            result = auth.authorize(sessdata, id, user_name);
-
-            if (result == Authorizer::Result::SUCCESS) {
-                Json::Value reqbody;
-                Json::Reader reader;
-                reader.parse(req.body, reqbody);
-                result = auth.raise_friend_request(id, reqbody["requestee_id"].asInt());
-                if (result == Authorizer::Result::ALREADY_FRIEND)
-                    res.set_content("ALREADY_FRIEND", "text/plain");
-                else if (result == Authorizer::Result::ALREADY_REQUESTED)
-                    res.set_content("ALREADY_REQUESTED", "text/plain");
-                else if (result == Authorizer::Result::USER_DONOT_EXIST)
-                    res.set_content("USER_DONOT_EXIST", "text/plain");
-                else if (result == Authorizer::Result::CANNOT_REQUEST_SELF)
-                    res.set_content("CANNOT_REQUEST_SELF", "text/plain");
-                else
-                    res.set_content("SUCCESS", "text/plain");
-            }
-            else {
-                res.set_content("PLEASE_LOG_IN", "text/plain");
-            }
+            // Sent straight from the cached buffer, which the provider keeps alive
+            res.set_content_provider(
+                icon->content.size(),
+                "image/png",
+                [icon](size_t offset, size_t len, httplib::DataSink& sink) {
+                    sink.write(icon->content.data() + offset, len);
+                    return true;
+                }
+            );
 
             }
         );
 
-        server.Get("/get-friend-requests", [this](const httplib::Request& req, httplib::Response& res) {
-            res.set_header("Access-Control-Allow-Origin", req.get_header_value("Origin"));
-            res.set_header("Access-Control-Allow-Credentials", "true");
+        Post("/set-name", with_session([this](const httplib::Request& req, httplib::Response& res, int id, const std::string& user_name) {
+            Json::Value reqbody;
+            Json::Reader reader;
+            reader.parse(req.body, reqbody);
+            auto result = auth.set_user_name(id, reqbody["user_name"].asString());
+            if (result == Authorizer::Result::SUCCESS) {
+                res.set_content("SUCCESS", "text/plain");
+                res.set_header("Set-Cookie", "user_name=" + reqbody["user_name"].asString()
+                    + "; Max-Age=" + std::to_string(cookie_max_age));
+                // The old token carries the old name version
+                res.set_header("Set-Cookie", "token=" + auth.issue_token(id, cookie_max_age) + "; Max-Age=" + std::to_string(cookie_max_age));
+                elog.write(websocketpp::log::elevel::info, "User '" + user_name + "'(#" + std::to_string(id)
+                    + ") changed name to '" + reqbody["user_name"].asString() + "'.");
+            }
+            else if (result == Authorizer::Result::USERNAME_DUPLICATE)
+                res.set_content("USERNAME_DUPLICATE", "text/plain");
+            else
+                res.set_content("FAILED", "text/plain");
+            })
+        );
 
-            bool failed;
-            auto sessdata = parse_cookie(req.get_header_value("Cookie"), failed);
-            if (failed) {
-                res.set_content("PLEASE_LOG_IN", "text/plain");
-                return;
-            }
+        Post("/friend-request", with_session([this](const httplib::Request& req, httplib::Response& res, int id, const std::string&) {
+            Json::Value reqbody;
+            Json::Reader reader;
+            reader.parse(req.body, reqbody);
+            auto result = auth.raise_friend_request(id, reqbody["requestee_id"].asInt());
+            if (result == Authorizer::Result::ALREADY_FRIEND)
+                res.set_content("ALREADY_FRIEND", "text/plain");
+            else if (result == Authorizer::Result::ALREADY_REQUESTED)
+                res.set_content("ALREADY_REQUESTED", "text/plain");
+            else if (result == Authorizer::Result::USER_DONOT_EXIST)
+                res.set_content("USER_DONOT_EXIST", "text/plain");
+            else if (result == Authorizer::Result::CANNOT_REQUEST_SELF)
+                res.set_content("CANNOT_REQUEST_SELF", "text/plain");
+            else
+                res.set_content("SUCCESS", "text/plain");
+            })
+        );
 
-            Authorizer::Result result;
-            int id; std::string user_name;
-            result = auth.authorize(sessdata, id, user_name);
+        Get("/get-friend-requests", with_session([this](const httplib::Request& req, httplib::Response& res, int id, const std::string&) {
+            Json::Value v;
+            auto result = db.run(DbExecutor::Priority::NORMAL, [&] { return auth.get_friend_requests(id, v); });
+            if (result == Authorizer::Result::SUCCESS)
+                compressor.set_content(req, res, Json::FastWriter().write(v), "application/json");
+            else 
+                res.set_content("FAILED", "text/plain");
+            })
+        );
 
-            if (result == Authorizer::Result::SUCCESS) {
-                Json::Value v;
-                result = auth.get_friend_requests(id, v);
-                if (result == Authorizer::Result::SUCCESS)
-                    res.set_content(Json::FastWriter().write(v), "application/json");
-                else 
-                    res.set_content("FAILED", "text/plain");
-            }
-            else {
-                res.set_content("PLEASE_LOG_IN", "text/plain");
-            }
+        Post("/handle-friend-request", with_session([this](const httplib::Request& req, httplib::Response& res, int id, const std::string&) {
+            Json::Value reqbody;
+            Json::Reader reader;
+            reader.parse(req.body, reqbody);
+            auto result = reqbody["accept"].asBool()
+                ? auth.accept_friend_request(id, reqbody["requester_id"].asInt())
+                : auth.remove_friend_request(id, reqbody["requester_id"].asInt());
 
-            }
+            if(result == Authorizer::Result::SUCCESS)
+                res.set_content("SUCCESS", "text/plain");
+            else 
+                res.set_content("FAILED", "text/plain");
+            })
         );
 
-        server.Options("/handle-friend-request", [](const httplib::Request& req, httplib::Response& res) {
-            res.set_header("Access-Control-Allow-Origin", req.get_header_value("Origin"));
-            res.set_header("Access-Control-Allow-Credentials", "true");
-            res.set_header("Access-Control-Allow-Headers", "Content-Type, x-requested-with");
-            }
+        Get("/get-friend-list", with_session([this](const httplib::Request& req, httplib::Response& res, int id, const std::string&) {
+            auto list = db.run(DbExecutor::Priority::NORMAL, [&] { return auth.get_friend_list(id); });
+            compressor.set_content(req, res, Json::FastWriter().write(list), "application/json");
+            })
         );
 
-        server.Post("/handle-friend-request", [this](const httplib::Request& req, httplib::Response& res) {
-            res.set_header("Access-Control-Allow-Origin", req.get_header_value("Origin"));
-            res.set_header("Access-Control-Allow-Credentials", "true");
+        Get("/get-chat-history", with_session([this](const httplib::Request& req, httplib::Response& res, int id, const std::string&) {
+            auto cursor = parse_chat_cursor(req);
+            auto history = db.run(DbExecutor::Priority::HEAVY, [&] { return chat_history.get_chat_message(id, cursor); });
+            compressor.set_content(req, res, std::move(history), "application/json");
+            })
+        );
 
-            bool failed;
-            auto sessdata = parse_cookie(req.get_header_value("Cookie"), failed);
-            if (failed) {
-                res.set_content("PLEASE_LOG_IN", "text/plain");
-                return;
+        Get("/get-chat-history-20", with_session([this](const httplib::Request& req, httplib::Response& res, int id, const std::string&) {
+            auto it = req.params.find("friend_id");
+            if (it != req.params.end()) {
+                int friend_id = std::atoi(it->second.c_str());
+                auto cursor = parse_chat_cursor(req);
+                auto history = db.run(DbExecutor::Priority::HEAVY, [&] { return chat_history.get_20_chat_messages(id, friend_id, cursor); });
+                compressor.set_content(req, res, std::move(history), "application/json");
             }
+            else
+                res.set_content("MISS_PARAMS", "text/plain");
+            })
+        );
 
-            Authorizer::Result result;
-            int id; std::string user_name;
-            result = auth.authorize(sessdata, id, user_name);
-
-            if (result == Authorizer::Result::SUCCESS) {
-                Json::Value reqbody;
-                Json::Reader reader;
-                reader.parse(req.body, reqbody);
-                if (reqbody["accept"].asBool())
-                    result = auth.accept_friend_request(id, reqbody["requester_id"].asInt());
-                else 
-                    result = auth.remove_friend_request(id, reqbody["requester_id"].asInt());
-
-                if(result == Authorizer::Result::SUCCESS)
-                    res.set_content("SUCCESS", "text/plain");
-                else 
-                    res.set_content("FAILED", "text/plain");
-            }
-            else {
-                res.set_content("PLEASE_LOG_IN", "text/plain");
+        Get("/get-user-info", [this](const httplib::Request& req, httplib::Response& res) {
+            auto it = req.params.find("id");
+            if (it != req.params.end()) {
+                int id = std::atoi(it->second.c_str());
+                auto info = db.run(DbExecutor::Priority::NORMAL, [&] { return auth.get_user_info(id); });
+                res.set_content(Json::FastWriter().write(info), "application/json");
             }
-            
+            else 
+                res.set_content("MISS_PARAMS", "text/plain");
+
             }
         );
 
-        server.Get("/get-friend-list", [this](const httplib::Request& req, httplib::Response& res) {
-            res.set_header("Access-Control-Allow-Origin", req.get_header_value("Origin"));
-            res.set_header("Access-Control-Allow-Credentials", "true");
-
-            bool failed;
-            auto sessdata = parse_cookie(req.get_header_value("Cookie"), failed);
-            if (failed) {
-                res.set_content("PLEASE_LOG_IN", "text/plain");
+        // Internal counters for whoever runs the server: only from this host and not from a web page,
+        // which would send an Origin that pre_route lets read the response
+        Get("/server-stats", [this](const httplib::Request& req, httplib::Response& res) {
+            if (!is_loopback(req.remote_addr) || req.has_header("Origin")) {
+                res.status = 403;
                 return;
             }
+            Json::Value stats;
+            stats["chat_history"] = chat_history.get_stats();
+            stats["db_executor"] = db.get_stats();
+            stats["icons"] = icons.get_stats();
+            stats["legacy_icons"] = legacy_icons.get_stats();
+            stats["compression"] = compressor.get_stats();
+            stats["user_writes"] = auth.get_write_stats();
+            stats["sessions"] = auth.get_session_stats();
+            stats["events"] = EventBus::get_instance().get_stats();
+            stats["presence"] = Presence::get_instance().get_stats();
+            stats["timers"] = Timers::get_instance().get_stats();
+            res.set_content(Json::FastWriter().write(stats), "application/json");
 
-            Authorizer::Result result;
-            int id; std::string user_name;
-            result = auth.authorize(sessdata, id, user_name);
-
-            if (result == Authorizer::Result::SUCCESS) {
-                auto list = auth.get_friend_list(id);
-                res.set_content(Json::FastWriter().write(list), "application/json");
-            }
-            else {
-                res.set_content("PLEASE_LOG_IN", "text/plain");
-            }
-            
             }
         );
 
-        server.Get("/get-chat-history", [this](const httplib::Request& req, httplib::Response& res) {
-            res.set_header("Access-Control-Allow-Origin", req.get_header_value("Origin"));
-            res.set_header("Access-Control-Allow-Credentials", "true");
-
-            bool failed;
-            auto sessdata = parse_cookie(req.get_header_value("Cookie"), failed);
-            if (failed) {
-                res.set_content("PLEASE_LOG_IN", "text/plain");
-                return;
+        Post("/set-slogan", with_session([this](const httplib::Request& req, httplib::Response& res, int id, const std::string& user_name) {
+            Json::Value reqbody;
+            Json::Reader reader;
+            reader.parse(req.body, reqbody);
+            auto result = auth.set_slogan(id, reqbody["slogan"].asString());
+            if (result == Authorizer::Result::SUCCESS) {
+                res.set_content("SUCCESS", "text/plain");
+                elog.write(websocketpp::log::elevel::info, "User '" + user_name + "'(#" + std::to_string(id)
+                    + ") changed slogan to '" + reqbody["slogan"].asString() + "'.");
             }
+            else
+                res.set_content("FAILED", "text/plain");
+            })
+        );
+    }
 
-            Authorizer::Result result;
-            int id; std::string user_name;
-            result = auth.authorize(sessdata, id, user_name);
+    // level is a zlib level (0-9, -1 for the default), smaller bodies are not compressed
+    void set_compression(int level, size_t threshold) {
+        compressor.configure(level, threshold);
+    }
 
-            if (result == Authorizer::Result::SUCCESS) {
-                auto it = req.params.find("latest_timestamp");
-                long long timestamp;
-                if (it != req.params.end())
-                    timestamp = std::atoll(it->second.c_str());
+    // Dispatches a request that did not come through httplib, to the same routes
+    void handle(httplib::Request& req, httplib::Response& res) {
+        if (pre_route(req, res) == httplib::Server::HandlerResponse::Handled)
+            return;
+        for (auto& route : routes) {
+            if (route.method != req.method || !std::regex_match(req.path, req.matches, route.pattern))
+                continue;
+            try {
+                if (route.handler)
+                    route.handler(req, res);
                 else
-                    timestamp = chat_history.get_timestamp();
-                auto history = chat_history.get_chat_message(id, timestamp);
-                res.set_content(Json::FastWriter().write(history), "application/json");
+                    route.handler_with_content_reader(req, res, buffered_content_reader(req));
+                if (res.status == -1)
+                    res.status = 200;
             }
-            else {
-                res.set_content("PLEASE_LOG_IN", "text/plain");
+            catch (const std::exception&) {
+                res.status = 500;
             }
+            return;
+        }
+        res.status = 404;
+    }
 
-            }
-        );
+    ~HttpServer() {
+        if (handle_http_threads)
+            handle_http_threads->shutdown();
+    }
 
-        server.Get("/get-chat-history-20", [this](const httplib::Request& req, httplib::Response& res) {
-            res.set_header("Access-Control-Allow-Origin", req.get_header_value("Origin"));
-            res.set_header("Access-Control-Allow-Credentials", "true");
+    // Serves a plain HTTP request that arrived at the WebSocket port, from websocketpp's http handler.
+    // The response is deferred: the handler runs on handle_http_threads, then the response is
+    // filled in and sent on the connection's strand.
+    template <typename ConnectionPtr>
+    void handle_http(ConnectionPtr con) {
+        std::call_once(handle_http_threads_started, [this] {
+            handle_http_threads.reset(new httplib::ThreadPool(http_threads));
+            });
+
+        auto& request = con->get_request();
+        httplib::Request req;
+        req.method = request.get_method();
+        req.target = request.get_uri();
+        auto query = req.target.find('?');
+        req.path = httplib::detail::decode_url(req.target.substr(0, query), false);
+        if (query != std::string::npos)
+            httplib::detail::parse_query_text(req.target.substr(query + 1), req.params);
+        for (auto& [key, value] : request.get_headers())
+            req.headers.emplace(key, value);
+        req.body = request.get_body();
+        websocketpp::lib::asio::error_code ec;
+        auto remote = con->get_raw_socket().remote_endpoint(ec);
+        if (!ec)
+            req.remote_addr = remote.address().to_string();
+
+        con->defer_http_response();
+        handle_http_threads->enqueue([this, con, req = std::move(req)]() mutable {
+            auto res = std::make_shared<httplib::Response>();
+            handle(req, *res);
+            con->get_strand()->post([this, con, res] {
+                send_response(con, *res);
+                });
+            });
+    }
 
-            bool failed;
-            auto sessdata = parse_cookie(req.get_header_value("Cookie"), failed);
-            if (failed) {
-                res.set_content("PLEASE_LOG_IN", "text/plain");
-                return;
-            }
+private:
+    template <typename ConnectionPtr>
+    void send_response(ConnectionPtr con, httplib::Response& res) {
+        std::string body = std::move(res.body);
+        if (res.content_provider_) {
+            httplib::DataSink sink;
+            sink.write = [&body](const char* data, size_t len) {
+                body.append(data, len);
+                return true;
+            };
+            sink.is_writable = [] { return true; };
+            res.content_provider_(0, res.content_length_, sink);
+        }
 
-            Authorizer::Result result;
-            int id; std::string user_name;
-            result = auth.authorize(sessdata, id, user_name);
+        con->set_status(static_cast<websocketpp::http::status_code::value>(res.status));
+        std::string cookies;
+        for (auto& [key, value] : res.headers) {
+            // websocketpp keeps one value per header and would fold them, which breaks cookies
+            if (key == "Set-Cookie")
+                cookies += cookies.empty() ? value : "\r\nSet-Cookie: " + value;
+            else
+                con->append_header(key, value);
+        }
+        if (!cookies.empty())
+            con->append_header("Set-Cookie", cookies);
+        // websocketpp closes the connection after an HTTP response
+        con->append_header("Connection", "close");
+        con->set_body(body);
+        websocketpp::lib::error_code ec;
+        con->send_http_response(ec);
+    }
 
-            if (result == Authorizer::Result::SUCCESS) {
-                auto it = req.params.find("latest_timestamp");
-                auto it1 = req.params.find("friend_id");
-                if (it != req.params.end() && it1 != req.params.end()) {
-                    long long timestamp = std::atoll(it->second.c_str());
-                    int friend_id = std::atoi(it1->second.c_str());
-                    auto history = chat_history.get_20_chat_messages(id, friend_id, timestamp);
-                    res.set_content(Json::FastWriter().write(history), "application/json");
-                }
-                else
-                    res.set_content("MISS_PARAMS", "text/plain");
-            }
-            else {
-                res.set_content("PLEASE_LOG_IN", "text/plain");
-            }
+public:
 
-            }
-        );
+    void run(int port) {
+        try {
+            server.listen("0.0.0.0", port);
+        }
+        catch (const std::exception& e) {
+            std::cout << e.what() << std::endl;
+        }
+    }
 
-        server.Get("/get-user-info", [this](const httplib::Request& req, httplib::Response& res) {
-            res.set_header("Access-Control-Allow-Origin", req.get_header_value("Origin"));
-            res.set_header("Access-Control-Allow-Credentials", "true");
+private:
+    void Get(const std::string& pattern, httplib::Server::Handler handler) {
+        routes.push_back({ "GET", std::regex(pattern), handler, nullptr });
+        server.Get(pattern, std::move(handler));
+    }
 
-            auto it = req.params.find("id");
-            if (it != req.params.end())
-                res.set_content(Json::FastWriter().write(auth.get_user_info(std::atoi(it->second.c_str()))), "application/json");
-            else 
-                res.set_content("MISS_PARAMS", "text/plain");
+    void Post(const std::string& pattern, httplib::Server::Handler handler) {
+        routes.push_back({ "POST", std::regex(pattern), handler, nullptr });
+        server.Post(pattern, std::move(handler));
+    }
 
-            }
-        );
+    void Post(const std::string& pattern, httplib::Server::HandlerWithContentReader handler) {
+        routes.push_back({ "POST", std::regex(pattern), nullptr, handler });
+        server.Post(pattern, std::move(handler));
+    }
 
-        server.Options("/set-slogan", [](const httplib::Request& req, httplib::Response& res) {
-            res.set_header("Access-Control-Allow-Origin", req.get_header_value("Origin"));
-            res.set_header("Access-Control-Allow-Credentials", "true");
-            res.set_header("Access-Control-Allow-Headers", "Content-Type, x-requested-with");
-            }
-        );
+    // CORS headers are added to every response here, and preflights never reach the routes.
+    // Browsers cache the preflight for preflight_max_age instead of sending one before every call.
+    httplib::Server::HandlerResponse pre_route(const httplib::Request& req, httplib::Response& res) {
+        res.set_header("Access-Control-Allow-Origin", req.get_header_value("Origin"));
+        res.set_header("Access-Control-Allow-Credentials", "true");
+        if (req.method != "OPTIONS")
+            return httplib::Server::HandlerResponse::Unhandled;
+        res.set_header("Access-Control-Allow-Methods", "GET, POST, OPTIONS");
+        res.set_header("Access-Control-Allow-Headers", "Content-Type, x-requested-with");
+        res.set_header("Access-Control-Max-Age", std::to_string(preflight_max_age));
+        res.status = 204;
+        return httplib::Server::HandlerResponse::Handled;
+    }
 
-        server.Post("/set-slogan", [this](const httplib::Request& req, httplib::Response& res) {
-            res.set_header("Access-Control-Allow-Origin", req.get_header_value("Origin"));
-            res.set_header("Access-Control-Allow-Credentials", "true");
+    static bool is_loopback(const std::string& addr) {
+        return addr.rfind("127.", 0) == 0 || addr.rfind("::ffff:127.", 0) == 0 || addr == "::1";
+    }
 
-            bool failed;
-            auto sessdata = parse_cookie(req.get_header_value("Cookie"), failed);
-            if (failed) {
-                res.set_content("PLEASE_LOG_IN", "text/plain");
-                return;
+    // Reads a body that is already in memory, like httplib reads one from the socket
+    static httplib::ContentReader buffered_content_reader(const httplib::Request& req) {
+        return httplib::ContentReader(
+            [&req](httplib::ContentReceiver receiver) {
+                return receiver(req.body.data(), req.body.size());
+            },
+            [&req](httplib::MultipartContentHeader header, httplib::ContentReceiver receiver) {
+                std::string boundary;
+                if (!httplib::detail::parse_multipart_boundary(req.get_header_value("Content-Type"), boundary))
+                    return false;
+                httplib::detail::MultipartFormDataParser parser;
+                parser.set_boundary(std::move(boundary));
+                return parser.parse(req.body.data(), req.body.size(), receiver, header) && parser.is_valid();
             }
+        );
+    }
 
-            Authorizer::Result result;
+    // The session is resolved once, before the handler runs
+    httplib::Server::Handler with_session(SessionHandler handler) {
+        return [this, handler](const httplib::Request& req, httplib::Response& res) {
             int id; std::string user_name;
-            result = auth.authorize(sessdata, id, user_name);
-
-            if (result == Authorizer::Result::SUCCESS) {
-                Json::Value reqbody;
-                Json::Reader reader;
-                reader.parse(req.body, reqbody);
-                result = auth.set_slogan(id, reqbody["slogan"].asString());
-                if (result == Authorizer::Result::SUCCESS) {
-                    res.set_content("SUCCESS", "text/plain");
-                    elog.write(websocketpp::log::elevel::info, "User '" + user_name + "'(#" + std::to_string(id)
-                        + ") changed slogan to '" + reqbody["slogan"].asString() + "'.");
-                }
-                else
-                    res.set_content("FAILED", "text/plain");
-            }
-            else {
+            if (resolve_session(req, id, user_name))
+                handler(req, res, id, user_name);
+            else
                 res.set_content("PLEASE_LOG_IN", "text/plain");
-            }
+            };
+    }
 
-            }
-        );
+    // The session is resolved before any of the body is read
+    httplib::Server::HandlerWithContentReader with_session(SessionHandlerWithContentReader handler) {
+        return [this, handler](const httplib::Request& req, httplib::Response& res, const httplib::ContentReader& content_reader) {
+            int id; std::string user_name;
+            if (resolve_session(req, id, user_name))
+                handler(req, res, id, user_name, content_reader);
+            else
+                res.set_content("PLEASE_LOG_IN", "text/plain");
+            };
     }
 
-    void run(int port) {
-        try {
-            server.listen("0.0.0.0", port);
-        }
-        catch (const std::exception& e) {
-            std::cout << e.what() << std::endl;
-        }
+    bool resolve_session(const httplib::Request& req, int& id, std::string& user_name) {
+        auto cookie = req.get_header_value("Cookie");
+        // Signed tokens are checked in memory, sessdata is still accepted from older clients
+        auto token = Cookie::get(cookie, "token");
+        if (!token.empty() && auth.authorize_token(token, id, user_name) == Authorizer::Result::SUCCESS)
+            return true;
+
+        bool failed;
+        auto sessdata = parse_cookie(cookie, failed);
+        if (failed)
+            return false;
+        return auth.authorize(sessdata, id, user_name) == Authorizer::Result::SUCCESS;
     }
 
-private:
     unsigned int parse_cookie(const std::string& cookie, bool& failed) {
         failed = false;
         auto pos = cookie.find("sessdata=");
@@ -595,6 +693,29 @@ private:
         while (std::isdigit(cookie[pos + cnt]))++cnt;
         return std::atoll(cookie.substr(pos, cnt).c_str());
     }
+
+    // Pages are requested with the id of the oldest message the client has (before_id).
+    // latest_timestamp is still accepted for older clients.
+    ChatCursor parse_chat_cursor(const httplib::Request& req) {
+        ChatCursor cursor;
+        auto it = req.params.find("before_id");
+        if (it != req.params.end())
+            cursor.before_id = std::atoll(it->second.c_str());
+        it = req.params.find("latest_timestamp");
+        if (it != req.params.end())
+            cursor.before_timestamp = std::atoll(it->second.c_str());
+        return cursor;
+    }
+
+    // <40 hex digits>.png, as stored by IconUpload
+    static bool is_content_name(const std::string& name) {
+        if (name.size() != 44 || name.compare(40, 4, ".png") != 0)
+            return false;
+        for (int i = 0; i < 40; ++i)
+            if (!std::isxdigit(static_cast<unsigned char>(name[i])))
+                return false;
+        return true;
+    }
 };
 
 #endif
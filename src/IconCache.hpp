@@ -0,0 +1,159 @@
+#ifndef ICON_CACHE_HPP
+#define ICON_CACHE_HPP
+
+#include <string>
+#include <list>
+#include <unordered_map>
+#include <memory>
+#include <mutex>
+#include <fstream>
+#include <sstream>
+#include <ctime>
+#include <cstdint>
+
+#include <sys/stat.h>
+#include <json/json.h>
+
+// Icon files kept in memory with their validators.
+// The least recently used icons are dropped once the memory budget is exceeded.
+class IconCache {
+public:
+    struct Icon {
+        std::string content;
+        std::string etag;           // Strong ETag, a hash of the content
+        std::string last_modified;  // HTTP date of the file's mtime, empty if unknown
+        time_t mtime;
+    };
+
+private:
+    struct Entry {
+        std::shared_ptr<const Icon> icon;
+        std::list<std::string>::iterator lru_it;
+    };
+
+    std::string dir;
+    size_t memory_budget;
+    size_t bytes = 0;
+
+    std::unordered_map<std::string, Entry> icons;
+    std::list<std::string> lru;     // Most recently used at the front
+    std::mutex mutex;
+
+    unsigned long long hits = 0;
+    unsigned long long misses = 0;
+    unsigned long long evictions = 0;
+
+public:
+    IconCache(const std::string& dir, size_t memory_budget)
+        :dir(dir), memory_budget(memory_budget) {}
+
+    // Returns nullptr if there is no such icon
+    std::shared_ptr<const Icon> get(const std::string& name) {
+        return get(name, [this, &name] { return load(name); });
+    }
+
+    // For icons that are not files, load returns the icon (from make_icon) or nullptr
+    template <typename Loader>
+    std::shared_ptr<const Icon> get(const std::string& name, Loader load) {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            auto it = icons.find(name);
+            if (it != icons.end()) {
+                ++hits;
+                lru.splice(lru.begin(), lru, it->second.lru_it);
+                return it->second.icon;
+            }
+            ++misses;
+        }
+
+        // The icon is loaded without holding the lock
+        std::shared_ptr<const Icon> icon = load();
+        if (!icon)
+            return nullptr;
+
+        std::lock_guard<std::mutex> lock(mutex);
+        if (icons.count(name))
+            return icon;
+        lru.push_front(name);
+        icons[name] = { icon, lru.begin() };
+        bytes += icon->content.size();
+        while (bytes > memory_budget && lru.size() > 1) {
+            auto& victim = icons[lru.back()];
+            bytes -= victim.icon->content.size();
+            icons.erase(lru.back());
+            lru.pop_back();
+            ++evictions;
+        }
+        return icon;
+    }
+
+    Json::Value get_stats() {
+        std::lock_guard<std::mutex> lock(mutex);
+        Json::Value res;
+        res["icons"] = static_cast<Json::UInt64>(icons.size());
+        res["bytes"] = static_cast<Json::UInt64>(bytes);
+        res["hits"] = static_cast<Json::UInt64>(hits);
+        res["misses"] = static_cast<Json::UInt64>(misses);
+        res["evictions"] = static_cast<Json::UInt64>(evictions);
+        return res;
+    }
+
+    // Whether the client's copy, described by the conditional headers, is still the current one.
+    // If-None-Match takes precedence over If-Modified-Since.
+    static bool not_modified(const Icon& icon, const std::string& if_none_match, const std::string& if_modified_since) {
+        if (!if_none_match.empty())
+            return if_none_match == "*" || if_none_match.find(icon.etag) != std::string::npos;
+        if (!if_modified_since.empty() && !icon.last_modified.empty()) {
+            std::tm tm{};
+            if (strptime(if_modified_since.c_str(), "%a, %d %b %Y %H:%M:%S GMT", &tm))
+                return icon.mtime <= timegm(&tm);
+        }
+        return false;
+    }
+
+    static std::string http_date(time_t t) {
+        std::tm tm{};
+        gmtime_r(&t, &tm);
+        char buf[64];
+        strftime(buf, sizeof(buf), "%a, %d %b %Y %H:%M:%S GMT", &tm);
+        return buf;
+    }
+
+    static std::shared_ptr<Icon> make_icon(std::string content, time_t mtime = 0) {
+        auto icon = std::make_shared<Icon>();
+        icon->content = std::move(content);
+        icon->etag = "\"" + fnv1a_hex(icon->content) + "\"";
+        icon->mtime = mtime;
+        if (mtime)
+            icon->last_modified = http_date(mtime);
+        return icon;
+    }
+
+private:
+    std::shared_ptr<const Icon> load(const std::string& name) {
+        auto path = dir + "/" + name;
+        struct stat st;
+        if (stat(path.c_str(), &st) != 0 || !S_ISREG(st.st_mode))
+            return nullptr;
+        std::ifstream fin(path, std::ios::binary);
+        if (!fin)
+            return nullptr;
+        std::ostringstream content;
+        content << fin.rdbuf();
+        return make_icon(content.str(), st.st_mtime);
+    }
+
+    // Stable across restarts, unlike std::hash
+    static std::string fnv1a_hex(const std::string& data) {
+        uint64_t hash = 14695981039346656037ull;
+        for (unsigned char c : data) {
+            hash ^= c;
+            hash *= 1099511628211ull;
+        }
+        char buf[17];
+        snprintf(buf, sizeof(buf), "%016llx", static_cast<unsigned long long>(hash));
+        return buf;
+    }
+};
+
+#endif
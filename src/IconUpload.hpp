@@ -0,0 +1,107 @@
+#ifndef ICON_UPLOAD_HPP
+#define ICON_UPLOAD_HPP
+
+#include <string>
+#include <fstream>
+#include <random>
+#include <cstdio>
+#include <filesystem>
+#include <system_error>
+
+#include <sys/stat.h>
+
+#include "Sha1.hpp"
+
+// Writes an uploaded icon to a temporary file while it is being received.
+// On commit the file is named after the hash of its content, so identical
+// icons are stored once and a stored file never changes.
+// Memory use does not depend on the size of the icon.
+class IconUpload {
+    std::string dir;
+    std::string tmp_path;
+    std::ofstream fout;
+    size_t max_size;
+    size_t size = 0;
+    bool too_large = false;
+    bool committed = false;
+
+public:
+    IconUpload(const std::string& dir, size_t max_size) :dir(dir), max_size(max_size) {
+        std::mt19937 mt_rand(std::random_device{}());
+        // Same directory as the icons, so the final rename is atomic
+        tmp_path = dir + "/.upload-" + std::to_string(mt_rand()) + ".tmp";
+        fout.open(tmp_path, std::ios::binary | std::ios::trunc);
+    }
+
+    IconUpload(const IconUpload&) = delete;
+    IconUpload& operator=(const IconUpload&) = delete;
+
+    ~IconUpload() {
+        if (!committed) {
+            fout.close();
+            std::remove(tmp_path.c_str());
+        }
+    }
+
+    // Returns false to stop receiving, when the file cannot be written or is too large
+    bool write(const char* data, size_t len) {
+        if (size + len > max_size) {
+            too_large = true;
+            return false;
+        }
+        fout.write(data, len);
+        size += len;
+        return static_cast<bool>(fout);
+    }
+
+    bool is_too_large() const {
+        return too_large;
+    }
+
+    size_t get_size() const {
+        return size;
+    }
+
+    // Drops the last bytes already written
+    void drop_tail(size_t len) {
+        size = len < size ? size - len : 0;
+    }
+
+    // Returns the name of the stored file, or an empty string on failure
+    std::string commit() {
+        if (too_large || !fout)
+            return "";
+        fout.close();
+        std::error_code ec;
+        std::filesystem::resize_file(tmp_path, size, ec);
+        if (ec)
+            return "";
+        auto name = hash_file();
+        if (name.empty())
+            return "";
+        name += ".png";
+
+        auto path = dir + "/" + name;
+        struct stat st;
+        if (stat(path.c_str(), &st) == 0)
+            return name;    // The same icon is already stored, the temporary file is removed
+        if (std::rename(tmp_path.c_str(), path.c_str()) != 0)
+            return "";
+        committed = true;
+        return name;
+    }
+
+private:
+    std::string hash_file() {
+        std::ifstream fin(tmp_path, std::ios::binary);
+        if (!fin)
+            return "";
+        Sha1 sha1;
+        char buf[64 << 10];
+        while (fin.read(buf, sizeof(buf)) || fin.gcount() > 0)
+            sha1.update(buf, static_cast<size_t>(fin.gcount()));
+        return sha1.hex_digest();
+    }
+};
+
+#endif
@@ -0,0 +1,154 @@
+#ifndef PRESENCE_HPP
+#define PRESENCE_HPP
+
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+#include <mutex>
+#include <thread>
+#include <chrono>
+#include <atomic>
+#include <functional>
+
+#include <json/json.h>
+
+#include "EventBus.hpp"
+
+// Who is online, counted from WebSocket connections, and who is friends with whom.
+// A change is reported to the online friends once it has held for debounce,
+// so a client that drops and reconnects at once is not reported at all.
+class Presence {
+    // Mirrors the relation table, a row per direction
+    std::unordered_map<int, std::unordered_set<int>> friends;
+    // Open connections of each user
+    std::unordered_map<int, int> connections;
+    // Users reported as online, which is what the friend list shows
+    std::unordered_set<int> online;
+    // Users whose connections changed, with the time of the first change
+    std::unordered_map<int, std::chrono::steady_clock::time_point> changed;
+    std::mutex mutex;
+
+    EventBus& events = EventBus::get_instance();
+
+    std::atomic<unsigned long long> reported{ 0 };
+    std::atomic<unsigned long long> suppressed{ 0 };
+    std::atomic<unsigned long long> pushed{ 0 };
+
+    static constexpr std::chrono::milliseconds debounce{ 2000 };
+
+    Presence() {
+        std::thread t(std::bind(&Presence::report_changes, this));
+        t.detach();
+    }
+
+public:
+    static Presence& get_instance() {
+        static Presence instance;
+        return instance;
+    }
+
+    void add_friend(int user_id, int friend_id) {
+        std::lock_guard<std::mutex> lock(mutex);
+        friends[user_id].insert(friend_id);
+    }
+
+    bool is_friend(int user_id, int friend_id) {
+        std::lock_guard<std::mutex> lock(mutex);
+        auto it = friends.find(user_id);
+        return it != friends.end() && it->second.count(friend_id);
+    }
+
+    std::vector<int> get_friends(int user_id) {
+        std::lock_guard<std::mutex> lock(mutex);
+        auto it = friends.find(user_id);
+        if (it == friends.end())
+            return {};
+        return std::vector<int>(it->second.begin(), it->second.end());
+    }
+
+    void connected(int user_id) {
+        std::lock_guard<std::mutex> lock(mutex);
+        ++connections[user_id];
+        changed.emplace(user_id, std::chrono::steady_clock::now());
+    }
+
+    void disconnected(int user_id) {
+        std::lock_guard<std::mutex> lock(mutex);
+        auto it = connections.find(user_id);
+        if (it == connections.end())
+            return;
+        if (--it->second == 0)
+            connections.erase(it);
+        changed.emplace(user_id, std::chrono::steady_clock::now());
+    }
+
+    bool is_online(int user_id) {
+        std::lock_guard<std::mutex> lock(mutex);
+        return online.count(user_id);
+    }
+
+    Json::Value get_stats() {
+        Json::Value res;
+        res["reported"] = static_cast<Json::UInt64>(reported.load());
+        res["suppressed"] = static_cast<Json::UInt64>(suppressed.load());
+        res["pushed"] = static_cast<Json::UInt64>(pushed.load());
+        std::lock_guard<std::mutex> lock(mutex);
+        res["online"] = static_cast<Json::UInt64>(online.size());
+        return res;
+    }
+
+private:
+    void report_changes() {
+        while (true) {
+            std::this_thread::sleep_for(debounce / 4);
+
+            // Recipients are picked under the lock, events are published without it
+            std::vector<std::pair<Json::Value, std::vector<int>>> out;
+            {
+                auto settled_before = std::chrono::steady_clock::now() - debounce;
+                std::lock_guard<std::mutex> lock(mutex);
+                for (auto it = changed.begin(); it != changed.end();) {
+                    if (it->second > settled_before) {
+                        ++it;
+                        continue;
+                    }
+                    int user_id = it->first;
+                    it = changed.erase(it);
+
+                    bool now_online = connections.count(user_id);
+                    if (now_online == static_cast<bool>(online.count(user_id))) {
+                        ++suppressed;
+                        continue;
+                    }
+                    if (now_online)
+                        online.insert(user_id);
+                    else
+                        online.erase(user_id);
+                    ++reported;
+
+                    auto list = friends.find(user_id);
+                    if (list == friends.end())
+                        continue;
+                    std::vector<int> recipients;
+                    for (int friend_id : list->second)
+                        if (connections.count(friend_id))
+                            recipients.push_back(friend_id);
+                    if (recipients.empty())
+                        continue;
+                    Json::Value event;
+                    event["message_type"] = "PRESENCE";
+                    event["user_id"] = user_id;
+                    event["online"] = now_online;
+                    out.emplace_back(std::move(event), std::move(recipients));
+                }
+            }
+
+            for (auto& [event, recipients] : out) {
+                pushed += recipients.size();
+                events.publish_many(recipients, event);
+            }
+        }
+    }
+};
+
+#endif
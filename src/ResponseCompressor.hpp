@@ -0,0 +1,124 @@
+#ifndef RESPONSE_COMPRESSOR_HPP
+#define RESPONSE_COMPRESSOR_HPP
+
+#include <string>
+#include <atomic>
+#include <chrono>
+#include <cstdlib>
+
+#include <zlib.h>
+#include <httplib.h>
+#include <json/json.h>
+
+// Compresses response bodies with gzip or deflate, depending on the Accept-Encoding of the request.
+// Small bodies are sent as they are, compressing them costs more than it saves.
+class ResponseCompressor {
+    std::atomic<int> level{ Z_DEFAULT_COMPRESSION };
+    std::atomic<size_t> threshold{ 1024 };
+
+    std::atomic<unsigned long long> responses{ 0 };
+    std::atomic<unsigned long long> compressed{ 0 };
+    std::atomic<unsigned long long> bytes_in{ 0 };      // Size of the bodies that were compressed
+    std::atomic<unsigned long long> bytes_out{ 0 };     // and their size after compression
+    std::atomic<unsigned long long> total_us{ 0 };
+
+public:
+    enum class Encoding {
+        IDENTITY,
+        GZIP,
+        DEFLATE,
+    };
+
+    // level is a zlib level from 0 to 9, or -1 for zlib's default
+    void configure(int new_level, size_t new_threshold) {
+        level = new_level;
+        threshold = new_threshold;
+    }
+
+    void set_content(const httplib::Request& req, httplib::Response& res, std::string body, const char* content_type) {
+        ++responses;
+        res.set_header("Vary", "Accept-Encoding");
+        auto encoding = body.size() >= threshold ? negotiate(req.get_header_value("Accept-Encoding")) : Encoding::IDENTITY;
+        if (encoding != Encoding::IDENTITY) {
+            auto start = std::chrono::steady_clock::now();
+            std::string out;
+            if (compress(body, encoding, out)) {
+                total_us += std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start).count();
+                ++compressed;
+                bytes_in += body.size();
+                bytes_out += out.size();
+                res.set_header("Content-Encoding", encoding == Encoding::GZIP ? "gzip" : "deflate");
+                res.set_content(std::move(out), content_type);
+                return;
+            }
+        }
+        res.set_content(std::move(body), content_type);
+    }
+
+    Json::Value get_stats() const {
+        Json::Value res;
+        res["level"] = level.load();
+        res["threshold"] = static_cast<Json::UInt64>(threshold.load());
+        res["responses"] = static_cast<Json::UInt64>(responses.load());
+        res["compressed"] = static_cast<Json::UInt64>(compressed.load());
+        res["bytes_in"] = static_cast<Json::UInt64>(bytes_in.load());
+        res["bytes_out"] = static_cast<Json::UInt64>(bytes_out.load());
+        res["bytes_saved"] = static_cast<Json::UInt64>(bytes_in.load() - bytes_out.load());
+        res["total_us"] = static_cast<Json::UInt64>(total_us.load());
+        return res;
+    }
+
+    // gzip is preferred when both are accepted, encodings with q=0 are refused
+    static Encoding negotiate(const std::string& accept_encoding) {
+        bool gzip = false, deflate = false;
+        size_t pos = 0;
+        while (pos < accept_encoding.size()) {
+            auto end = accept_encoding.find(',', pos);
+            if (end == std::string::npos)
+                end = accept_encoding.size();
+            auto item = accept_encoding.substr(pos, end - pos);
+            pos = end + 1;
+
+            auto semicolon = item.find(';');
+            auto name = trim(item.substr(0, semicolon));
+            if (semicolon != std::string::npos) {
+                auto q = item.find("q=", semicolon);
+                if (q != std::string::npos && std::atof(item.c_str() + q + 2) <= 0)
+                    continue;
+            }
+            if (name == "gzip" || name == "x-gzip")
+                gzip = true;
+            else if (name == "deflate")
+                deflate = true;
+        }
+        return gzip ? Encoding::GZIP : deflate ? Encoding::DEFLATE : Encoding::IDENTITY;
+    }
+
+private:
+    bool compress(const std::string& in, Encoding encoding, std::string& out) const {
+        z_stream stream{};
+        // windowBits + 16 writes a gzip wrapper, HTTP's deflate is the zlib format
+        int window_bits = encoding == Encoding::GZIP ? 15 + 16 : 15;
+        if (deflateInit2(&stream, level, Z_DEFLATED, window_bits, 8, Z_DEFAULT_STRATEGY) != Z_OK)
+            return false;
+
+        out.resize(deflateBound(&stream, in.size()));
+        stream.next_in = reinterpret_cast<Bytef*>(const_cast<char*>(in.data()));
+        stream.avail_in = static_cast<uInt>(in.size());
+        stream.next_out = reinterpret_cast<Bytef*>(&out[0]);
+        stream.avail_out = static_cast<uInt>(out.size());
+        int ret = deflate(&stream, Z_FINISH);
+        out.resize(stream.total_out);
+        deflateEnd(&stream);
+        return ret == Z_STREAM_END;
+    }
+
+    static std::string trim(const std::string& s) {
+        auto begin = s.find_first_not_of(" \t");
+        if (begin == std::string::npos)
+            return "";
+        return s.substr(begin, s.find_last_not_of(" \t") - begin + 1);
+    }
+};
+
+#endif
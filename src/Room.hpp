@@ -5,6 +5,7 @@
 #include <unordered_map>
 #include <json/json.h>
 #include <set>
+#include <functional>
 
 #include "Responsor.hpp"
 
@@ -25,6 +26,7 @@ class Room:public Responsor<SendMsgFunc> {
     inline static std::unordered_map<int, unsigned> user_2_room_id{};
     std::string password;
     std::set<int> authorized_user_id;
+    std::function<void(unsigned)> game_end_handler;
 
 protected:
     std::unordered_map<unsigned, UserInfo> connections;
@@ -46,11 +48,20 @@ public:
     virtual std::string get_type() {
         return "Chat Room";
     }
+    // Most people a game can start with, 0 if there is no limit
+    virtual int get_max_players() {
+        return 0;
+    }
 
     bool get_is_game_on() {
         return is_game_on;
     }
 
+    // Told the room id when a game ends outside process_message
+    void set_game_end_handler(std::function<void(unsigned)> handler) {
+        game_end_handler = std::move(handler);
+    }
+
     std::string user_id_to_user_name(int id) {
         for (auto& conn : connections)
             if (conn.second.user_id == id)
@@ -68,6 +79,27 @@ public:
         authorized_user_id.emplace(creator_id);
     }
 
+    // Gives a recycled room to its next creator, as if it was just constructed
+    void reopen(
+        unsigned id, const std::string& creator, int creator_id,
+        const std::string& name, const std::string& password
+    ) {
+        this->id = id;
+        this->creator = creator;
+        this->name = name;
+        this->password = password;
+        authorized_user_id.clear();
+        authorized_user_id.emplace(creator_id);
+    }
+
+    // Called when the room closes. Forgets the people and the game, the memory is kept for the next room
+    virtual void recycle() {
+        for (auto& p : connections)
+            user_2_room_id.erase(p.second.user_id);
+        connections.clear();
+        is_game_on = false;
+    }
+
     virtual void process_message(
         unsigned conn_id,
         const std::string& user_name,
@@ -179,6 +211,13 @@ public:
 
     virtual void on_everyone_prepared() {}
 
+    // For a game decided on another thread. Not from process_message, whose caller looks at the room anyway
+    void end_game_elsewhere() {
+        is_game_on = false;
+        if (game_end_handler)
+            game_end_handler(id);
+    }
+
     virtual void process_close(unsigned conn_id) {
         if (connections.count(conn_id)) {
             if (is_game_on)
@@ -2,7 +2,10 @@
 #define ROOM_MANAGER_HPP
 
 #include <unordered_map>
+#include <map>
+#include <set>
 #include <memory>
+#include <vector>
 #include <thread>
 #include <mutex>
 
@@ -10,11 +13,57 @@
 #include "UnoRoom.hpp"
 #include "SplendorRoom.hpp"
 #include "GomokuRoom.hpp"
+#include "Timers.hpp"
+#include "SlotMap.hpp"
 
 template <typename SendMsgFunc>
 class RoomManager :public Responsor<SendMsgFunc> {
-    std::unordered_map<unsigned, std::unique_ptr<Room<SendMsgFunc>>> rooms;
+    // Ids are given by the server, a lookup is an array index
+    SlotMap<std::unique_ptr<Room<SendMsgFunc>>> rooms;
     std::mutex rooms_mutex;
+    // Closed rooms by type, recycled for the next rooms of that type with their game. Guarded by rooms_mutex
+    std::unordered_map<std::string, std::vector<std::unique_ptr<Room<SendMsgFunc>>>> spare_rooms;
+    static constexpr size_t max_spare_rooms = 1024;
+
+    // What the room list shows of a room, serialized when the room changes
+    struct Listing {
+        std::string type;
+        int num_of_people;
+        int max_players;
+        bool is_game_on;
+        Json::Value entry;
+        std::string serialized;
+    };
+    // Ordered by id so that pages stay put between requests. Guarded by rooms_mutex
+    std::map<unsigned, Listing> listings;
+    // Bumped on every change to listings
+    unsigned long long list_version = 0;
+    // The whole ROOM_LIST message, built on the first request after a change
+    std::string list_message;
+    unsigned long long list_message_version = 0;
+
+    // Connections that follow the room list, they get the changes of each tick in one message
+    std::set<unsigned> room_list_subscribers;
+    // Rooms changed since the last tick, and whether subscribers knew of them before
+    std::map<unsigned, bool> room_list_changes;
+
+    static constexpr std::chrono::milliseconds room_list_tick{ 250 };
+
+    // A room with no one online is closed when its timer fires, unless someone comes back first.
+    // The serial tells a timer that fired just as it was cancelled from the one that replaced it
+    struct RoomTimer {
+        Timers::Id id;
+        unsigned long long serial;
+        bool game_on;       // Whether it was given the delay of a game that is on
+    };
+    std::unordered_map<unsigned, RoomTimer> room_timers;
+    unsigned long long room_timer_serial = 0;
+    Timers& timers = Timers::get_instance();
+
+    // For a room no one joined or everyone left without a game on
+    static constexpr std::chrono::seconds room_idle_timeout{ 60 };
+    // For the players of a game that is on to come back
+    static constexpr std::chrono::seconds reconnect_grace{ 120 };
 
 public:
     RoomManager(const SendMsgFunc& send_msg) :Responsor<SendMsgFunc>(send_msg) {}
@@ -26,8 +75,8 @@ public:
         const std::string& message_type,
         const Json::Value& payload
     ) {
+        // The server picks the id and sends it back, a room_id in the payload is ignored
         if (message_type == "CREATE_ROOM") {
-            unsigned room_id = payload["room_id"].asUInt();
             std::string room_type = payload["room_type"].asString();
             Json::FastWriter writer;
             Json::Value res;
@@ -35,53 +84,45 @@ public:
             
             std::lock_guard<std::mutex> lock(rooms_mutex);
 
-            if (rooms.count(room_id)) {
+            auto room = take_room(room_type);
+            if (!room) {
                 res["success"] = false;
-                res["info"] = "Room " + std::to_string(room_id) + " already exists.";
+                res["info"] = "Unknown room type " + room_type + ".";
                 this->send_msg(conn_id, writer.write(res));
                 return;
             }
-
-            if (room_type == "UNO")
-                rooms.emplace(
-                    room_id,
-                    std::make_unique<UnoRoom<SendMsgFunc>>(
-                        this->send_msg, room_id, user_name, user_id, payload["room_name"].asString(), payload["password"].asString()
-                    )
-                );
-            else if (room_type == "SPLENDOR") 
-                rooms.emplace(
-                    room_id,
-                    std::make_unique<SplendorRoom<SendMsgFunc>>(
-                        this->send_msg, room_id, user_name, user_id, payload["room_name"].asString(), payload["password"].asString()
-                    )
-                );
-            else if(room_type == "GOMOKU")
-                rooms.emplace(
-                    room_id,
-                    std::make_unique<GomokuRoom<SendMsgFunc>>(
-                        this->send_msg, room_id, user_name, user_id, payload["room_name"].asString(), payload["password"].asString()
-                    )
-                );
+            auto r = room.get();
+            unsigned room_id = rooms.insert(std::move(room));
+            if (!room_id) {
+                res["success"] = false;
+                res["info"] = "Too many rooms.";
+                this->send_msg(conn_id, writer.write(res));
+                return;
+            }
+            r->reopen(room_id, user_name, user_id, payload["room_name"].asString(), payload["password"].asString());
+            room_changed(room_id);
             res["success"] = true;
+            res["room_id"] = room_id;
             this->send_msg(conn_id, writer.write(res));
         }
 
         else if (message_type == "GET_ROOM_LIST") {
-            Json::Value res;
-            res["message_type"] = "ROOM_LIST";
-            res["room_list"].resize(0);
             std::lock_guard<std::mutex> lock(rooms_mutex);
-            for (auto& room : rooms) {
-                Json::Value r;
-                r["name"] = room.second->get_name();
-                r["id"] = room.second->get_id();
-                r["creator"] = room.second->get_creator();
-                r["num_of_people"] = room.second->get_num_of_people();
-                r["type"] = room.second->get_type();
-                res["room_list"].append(r);
-            }
-            this->send_msg(conn_id, Json::FastWriter().write(res));
+            this->send_msg(conn_id, room_list_message(payload));
+        }
+
+        // The whole list, then ROOM_LIST_CHANGES until unsubscribed or closed
+        else if (message_type == "SUBSCRIBE_ROOM_LIST") {
+            std::lock_guard<std::mutex> lock(rooms_mutex);
+            // The others get what happened so far, so the snapshot and the changes after it line up
+            send_room_list_changes();
+            room_list_subscribers.insert(conn_id);
+            this->send_msg(conn_id, room_list_message(Json::Value()));
+        }
+
+        else if (message_type == "UNSUBSCRIBE_ROOM_LIST") {
+            std::lock_guard<std::mutex> lock(rooms_mutex);
+            room_list_subscribers.erase(conn_id);
         }
 
         else {
@@ -91,10 +132,12 @@ public:
             //unsigned room_id = Room<SendMsgFunc>::get_users_room_id(user_id);
             //unsigned room_id = payload["room_id"].asUInt();
             std::lock_guard<std::mutex> lock(rooms_mutex);
-            if (rooms.count(room_id))
-                rooms[room_id]->process_message(
+            if (auto room = rooms.find(room_id)) {
+                (*room)->process_message(
                     conn_id, user_name, user_id, message_type, payload
                 );
+                room_changed(room_id);
+            }
             else {
                 Json::Value res;
                 res["message_type"] = "ERROR";
@@ -104,30 +147,235 @@ public:
         }
     }
 
+    Json::Value get_room_list() {
+        Json::Value list;
+        list.resize(0);
+        std::lock_guard<std::mutex> lock(rooms_mutex);
+        for (auto& l : listings)
+            list.append(l.second.entry);
+        return list;
+    }
+
+    // 0 if the user is in no room
+    unsigned get_users_room_id(int user_id) {
+        return Room<SendMsgFunc>::get_users_room_id(user_id);
+    }
+
     void process_close(unsigned conn_id, int user_id){
         auto room_id = Room<SendMsgFunc>::get_users_room_id(user_id);
         std::lock_guard<std::mutex> lock(rooms_mutex);
-        if (rooms.count(room_id)) {
-            auto& r = rooms[room_id];
+        room_list_subscribers.erase(conn_id);
+        if (auto room = rooms.find(room_id)) {
+            auto& r = *room;
             r->process_close(conn_id);
             // 뿪ҷûϷʱرշ
             if (r->have_no_one_online() && !r->get_is_game_on())
-                rooms.erase(room_id);
+                close_room(room_id);
+            room_changed(room_id);
         }
     }
 
-    void check_empty_rooms() {
+    void publish_room_list_changes() {
         while (true) {
-            auto it = rooms.begin();
-            while (it != rooms.end()) {
-                if (it->second->have_no_one_online()) {
-                    std::lock_guard<std::mutex> lock(rooms_mutex);
-                    it = rooms.erase(it);
-                }
-                else std::advance(it, 1);
+            std::this_thread::sleep_for(room_list_tick);
+            std::lock_guard<std::mutex> lock(rooms_mutex);
+            send_room_list_changes();
+        }
+    }
+
+private:
+    // A recycled room of the type if there is one, null for an unknown type
+    std::unique_ptr<Room<SendMsgFunc>> take_room(const std::string& room_type) {
+        auto spare = spare_rooms.find(room_type);
+        if (spare != spare_rooms.end() && !spare->second.empty()) {
+            auto room = std::move(spare->second.back());
+            spare->second.pop_back();
+            return room;
+        }
+        // The creator and the rest are given by reopen
+        std::unique_ptr<Room<SendMsgFunc>> room;
+        if (room_type == "UNO")
+            room = std::make_unique<UnoRoom<SendMsgFunc>>(this->send_msg, 0, "", 0, "", "");
+        else if (room_type == "SPLENDOR")
+            room = std::make_unique<SplendorRoom<SendMsgFunc>>(this->send_msg, 0, "", 0, "", "");
+        else if (room_type == "GOMOKU")
+            room = std::make_unique<GomokuRoom<SendMsgFunc>>(this->send_msg, 0, "", 0, "", "");
+        if (room)
+            // The timer of an empty room changes its delay when the game ends
+            room->set_game_end_handler([this](unsigned room_id) {
+                std::lock_guard<std::mutex> lock(rooms_mutex);
+                room_changed(room_id);
+                });
+        return room;
+    }
+
+    // Needs rooms_mutex. The id stops finding the room at once, the room is kept for the next one
+    void close_room(unsigned room_id) {
+        auto room = rooms.erase(room_id);
+        if (!room)
+            return;
+        room->recycle();
+        auto& spare = spare_rooms[room->get_type()];
+        if (spare.size() < max_spare_rooms)
+            spare.push_back(std::move(room));
+    }
+
+    // Called with rooms_mutex held after anything that may have changed the room
+    void room_changed(unsigned room_id) {
+        update_room_timer(room_id);
+        update_listing(room_id);
+    }
+
+    // Starts the timer of a room when the last one online leaves, stops it when someone is back.
+    // A game that starts or ends meanwhile starts the timer again with the other delay.
+    void update_room_timer(unsigned room_id) {
+        auto room = rooms.find(room_id);
+        auto timer = room_timers.find(room_id);
+        bool idle = room && (*room)->have_no_one_online();
+        bool game_on = idle && (*room)->get_is_game_on();
+        if (timer != room_timers.end()) {
+            if (idle && timer->second.game_on == game_on)
+                return;
+            timers.cancel(timer->second.id);
+            room_timers.erase(timer);
+        }
+        if (!idle)
+            return;
+        auto delay = game_on ? reconnect_grace : room_idle_timeout;
+        auto serial = ++room_timer_serial;
+        room_timers[room_id] = { timers.schedule(delay, [this, room_id, serial] {
+            close_idle_room(room_id, serial);
+            }), serial, game_on };
+    }
+
+    // Runs on the timer thread
+    void close_idle_room(unsigned room_id, unsigned long long serial) {
+        std::lock_guard<std::mutex> lock(rooms_mutex);
+        auto timer = room_timers.find(room_id);
+        if (timer == room_timers.end() || timer->second.serial != serial)
+            return;
+        room_timers.erase(timer);
+        auto room = rooms.find(room_id);
+        if (room && (*room)->have_no_one_online())
+            close_room(room_id);
+        room_changed(room_id);
+    }
+
+    // A room is serialized again only when what the list shows of it changed
+    void update_listing(unsigned room_id) {
+        auto room = rooms.find(room_id);
+        if (!room) {
+            if (listings.erase(room_id)) {
+                ++list_version;
+                note_room_list_change(room_id, true);
             }
-            std::this_thread::sleep_for(std::chrono::minutes(5));
+            return;
         }
+
+        auto& r = *room;
+        auto it = listings.find(room_id);
+        if (it != listings.end()
+            && it->second.num_of_people == r->get_num_of_people()
+            && it->second.is_game_on == r->get_is_game_on())
+            return;
+        note_room_list_change(room_id, it != listings.end());
+
+        auto& l = listings[room_id];
+        l.type = r->get_type();
+        l.num_of_people = r->get_num_of_people();
+        l.max_players = r->get_max_players();
+        l.is_game_on = r->get_is_game_on();
+        l.entry["name"] = r->get_name();
+        l.entry["id"] = r->get_id();
+        l.entry["creator"] = r->get_creator();
+        l.entry["num_of_people"] = l.num_of_people;
+        l.entry["max_players"] = l.max_players;
+        l.entry["is_game_on"] = l.is_game_on;
+        l.entry["type"] = l.type;
+        Json::FastWriter writer;
+        writer.omitEndingLineFeed();
+        l.serialized = writer.write(l.entry);
+        ++list_version;
+    }
+
+    // The payload may filter by "type", "is_game_on" and "has_free_seats", and pick
+    // a page with "offset" and "limit". "total" counts the rooms that pass the filters.
+    // Without any of them the message is the cached one, rebuilt only after a change
+    std::string room_list_message(const Json::Value& payload) {
+        bool by_type = payload.isMember("type");
+        bool by_game_on = payload.isMember("is_game_on");
+        bool by_free_seats = payload.isMember("has_free_seats");
+        unsigned offset = payload.get("offset", 0).asUInt();
+        unsigned limit = payload.get("limit", 0).asUInt();
+        bool whole = !by_type && !by_game_on && !by_free_seats && offset == 0 && limit == 0;
+        if (whole && list_message_version == list_version && !list_message.empty())
+            return list_message;
+
+        auto type = payload["type"].asString();
+        bool game_on = payload["is_game_on"].asBool();
+        bool free_seats = payload["has_free_seats"].asBool();
+
+        std::string list;
+        unsigned total = 0, shown = 0;
+        for (auto& [room_id, l] : listings) {
+            if (by_type && l.type != type)
+                continue;
+            if (by_game_on && l.is_game_on != game_on)
+                continue;
+            if (by_free_seats && (l.max_players == 0 || l.num_of_people < l.max_players) != free_seats)
+                continue;
+            if (total++ < offset || (limit && shown == limit))
+                continue;
+            if (shown++)
+                list += ',';
+            list += l.serialized;
+        }
+
+        auto message = "{\"message_type\":\"ROOM_LIST\",\"version\":" + std::to_string(list_version)
+            + ",\"total\":" + std::to_string(total) + ",\"room_list\":[" + list + "]}\n";
+        if (whole) {
+            list_message = message;
+            list_message_version = list_version;
+        }
+        return message;
+    }
+
+    // Keeps the first state of the tick, nothing is kept while no one follows the list
+    void note_room_list_change(unsigned room_id, bool was_listed) {
+        if (!room_list_subscribers.empty())
+            room_list_changes.emplace(room_id, was_listed);
+    }
+
+    // Called with rooms_mutex held. Sends every subscriber one ROOM_LIST_CHANGES with a
+    // ROOM_ADDED, ROOM_UPDATED or ROOM_REMOVED per room that changed since the last call.
+    // A room that came and went in between is left out, "version" is that of the list after them
+    void send_room_list_changes() {
+        if (room_list_subscribers.empty()) {
+            room_list_changes.clear();
+            return;
+        }
+
+        std::string changes;
+        for (auto& [room_id, was_listed] : room_list_changes) {
+            auto it = listings.find(room_id);
+            if (it == listings.end() && !was_listed)
+                continue;
+            if (!changes.empty())
+                changes += ',';
+            if (it == listings.end())
+                changes += "{\"change\":\"ROOM_REMOVED\",\"id\":" + std::to_string(room_id) + "}";
+            else
+                changes += std::string("{\"change\":\"") + (was_listed ? "ROOM_UPDATED" : "ROOM_ADDED")
+                    + "\",\"room\":" + it->second.serialized + "}";
+        }
+        room_list_changes.clear();
+        if (changes.empty())
+            return;
+
+        auto message = "{\"message_type\":\"ROOM_LIST_CHANGES\",\"version\":" + std::to_string(list_version)
+            + ",\"changes\":[" + changes + "]}\n";
+        for (auto conn_id : room_list_subscribers)
+            this->send_msg(conn_id, message);
     }
 };
 
@@ -0,0 +1,118 @@
+#ifndef SESSION_TOKEN_HPP
+#define SESSION_TOKEN_HPP
+
+#include <string>
+#include <fstream>
+#include <iterator>
+#include <random>
+#include <mutex>
+#include <filesystem>
+#include <cstdlib>
+#include <ctime>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "Sha1.hpp"
+
+// Session tokens that are verified without the database.
+// A token is "<id>.<name_version>.<expiry>.<nonce>.<signature>", the signature is the HMAC-SHA1
+// of the rest under a key that is created once and kept in key_file.
+// The nonce tells apart tokens issued to the same user in the same second, so one can be revoked alone.
+class SessionToken {
+    std::string key;
+    std::mt19937 nonce_rand{ std::random_device{}() };
+    std::mutex nonce_mutex;
+
+public:
+    struct Claims {
+        int id = 0;
+        unsigned name_version = 0;
+        long long expiry = 0;       // Unix time
+        unsigned nonce = 0;
+    };
+
+    explicit SessionToken(const std::string& key_file) {
+        std::ifstream in(key_file, std::ios::binary);
+        key.assign(std::istreambuf_iterator<char>(in), std::istreambuf_iterator<char>());
+        if (key.size() >= 32)
+            return;
+
+        std::random_device rd;
+        key.resize(32);
+        for (auto& c : key)
+            c = static_cast<char>(rd());
+
+        // The file is created readable by the owner only before the key is in it.
+        // If it cannot be, the key is only kept in memory and tokens end with the process
+        std::error_code ec;
+        std::filesystem::remove(key_file, ec);
+        int fd = ::open(key_file.c_str(), O_CREAT | O_EXCL | O_WRONLY, 0600);
+        if (fd < 0)
+            return;
+        size_t written = 0;
+        while (written < key.size()) {
+            auto n = ::write(fd, key.data() + written, key.size() - written);
+            if (n <= 0)
+                break;
+            written += n;
+        }
+        ::close(fd);
+        if (written < key.size())
+            std::filesystem::remove(key_file, ec);
+    }
+
+    // Fills in the nonce
+    std::string sign(Claims& claims) {
+        {
+            std::lock_guard<std::mutex> lock(nonce_mutex);
+            claims.nonce = static_cast<unsigned>(nonce_rand());
+        }
+        auto payload = std::to_string(claims.id) + "." + std::to_string(claims.name_version) + "."
+            + std::to_string(claims.expiry) + "." + std::to_string(claims.nonce);
+        return payload + "." + Sha1::hmac(key, payload);
+    }
+
+    // Checks the format, the signature and the expiry, not whether the token was revoked
+    bool verify(const std::string& token, Claims& claims) const {
+        auto dot = token.rfind('.');
+        if (dot == std::string::npos || token.size() - dot - 1 != 40)
+            return false;
+        auto payload = token.substr(0, dot);
+        if (!equal(Sha1::hmac(key, payload), token.c_str() + dot + 1))
+            return false;
+
+        char* end = nullptr;
+        const char* p = payload.c_str();
+        claims.id = static_cast<int>(std::strtol(p, &end, 10));
+        if (*end != '.')
+            return false;
+        claims.name_version = static_cast<unsigned>(std::strtoul(end + 1, &end, 10));
+        if (*end != '.')
+            return false;
+        claims.expiry = std::strtoll(end + 1, &end, 10);
+        if (*end != '.')
+            return false;
+        claims.nonce = static_cast<unsigned>(std::strtoul(end + 1, &end, 10));
+        if (*end != '\0')
+            return false;
+        return claims.expiry > static_cast<long long>(std::time(nullptr));
+    }
+
+    // The part that identifies a token in the revocation list
+    static std::string signature(const std::string& token) {
+        auto dot = token.rfind('.');
+        return dot == std::string::npos ? std::string() : token.substr(dot + 1);
+    }
+
+private:
+    // Takes the same time wherever the first difference is
+    static bool equal(const std::string& expected, const char* actual) {
+        unsigned char diff = 0;
+        for (size_t i = 0; i < expected.size(); ++i)
+            diff |= static_cast<unsigned char>(expected[i] ^ actual[i]);
+        return diff == 0;
+    }
+};
+
+#endif
@@ -0,0 +1,115 @@
+#ifndef SHA1_HPP
+#define SHA1_HPP
+
+#include <string>
+#include <cstdint>
+#include <cstring>
+#include <algorithm>
+
+#include <websocketpp/sha1/sha1.hpp>
+
+// Incremental SHA1 on top of the block function of websocketpp,
+// whose own calc() needs the whole input in memory.
+class Sha1 {
+    unsigned int result[5] = { 0x67452301, 0xefcdab89, 0x98badcfe, 0x10325476, 0xc3d2e1f0 };
+    unsigned char block[64];
+    size_t block_size = 0;
+    uint64_t length = 0;
+
+public:
+    void update(const void* data, size_t len) {
+        auto bytes = static_cast<const unsigned char*>(data);
+        length += len;
+        while (len > 0) {
+            size_t n = std::min(len, sizeof(block) - block_size);
+            memcpy(block + block_size, bytes, n);
+            block_size += n;
+            bytes += n;
+            len -= n;
+            if (block_size == sizeof(block))
+                process_block();
+        }
+    }
+
+    // 20 bytes, the object should not be used afterwards
+    void digest(unsigned char out[20]) {
+        uint64_t bit_length = length << 3;
+        unsigned char pad = 0x80;
+        update(&pad, 1);
+        pad = 0;
+        while (block_size != 56)
+            update(&pad, 1);
+        for (int i = 7; i >= 0; --i) {
+            unsigned char c = static_cast<unsigned char>(bit_length >> (i * 8));
+            update(&c, 1);
+        }
+        for (int i = 0; i < 20; ++i)
+            out[i] = (result[i >> 2] >> ((3 - (i & 3)) << 3)) & 0xff;
+    }
+
+    // 40 lowercase hex digits, the object should not be used afterwards
+    std::string hex_digest() {
+        unsigned char bytes[20];
+        digest(bytes);
+        return to_hex(bytes, sizeof(bytes));
+    }
+
+    static std::string to_hex(const unsigned char* data, size_t len) {
+        static const char digits[] = "0123456789abcdef";
+        std::string res;
+        res.reserve(len * 2);
+        for (size_t i = 0; i < len; ++i) {
+            res += digits[data[i] >> 4];
+            res += digits[data[i] & 15];
+        }
+        return res;
+    }
+
+    static std::string hex_digest(const std::string& data) {
+        Sha1 sha1;
+        sha1.update(data.data(), data.size());
+        return sha1.hex_digest();
+    }
+
+    // HMAC-SHA1 (RFC 2104) of data, as 40 hex digits
+    static std::string hmac(const std::string& key, const std::string& data) {
+        unsigned char k[64] = {};
+        if (key.size() > sizeof(k)) {
+            Sha1 sha1;
+            sha1.update(key.data(), key.size());
+            sha1.digest(k);
+        }
+        else
+            memcpy(k, key.data(), key.size());
+
+        unsigned char pad[64];
+        for (int i = 0; i < 64; ++i)
+            pad[i] = k[i] ^ 0x36;
+        Sha1 inner;
+        inner.update(pad, sizeof(pad));
+        inner.update(data.data(), data.size());
+        unsigned char inner_digest[20];
+        inner.digest(inner_digest);
+
+        for (int i = 0; i < 64; ++i)
+            pad[i] = k[i] ^ 0x5c;
+        Sha1 outer;
+        outer.update(pad, sizeof(pad));
+        outer.update(inner_digest, sizeof(inner_digest));
+        return outer.hex_digest();
+    }
+
+private:
+    void process_block() {
+        unsigned int w[80];
+        for (int i = 0; i < 16; ++i)
+            w[i] = (static_cast<unsigned int>(block[i * 4]) << 24)
+                | (static_cast<unsigned int>(block[i * 4 + 1]) << 16)
+                | (static_cast<unsigned int>(block[i * 4 + 2]) << 8)
+                | static_cast<unsigned int>(block[i * 4 + 3]);
+        websocketpp::sha1::innerHash(result, w);
+        block_size = 0;
+    }
+};
+
+#endif
@@ -0,0 +1,87 @@
+#ifndef SLOT_MAP_HPP
+#define SLOT_MAP_HPP
+
+#include <vector>
+#include <utility>
+#include <cstddef>
+
+// Values in a vector, found by an id that holds the index of their slot, so a lookup is an
+// array index. The generation of a slot is bumped when it is freed, so an old id does not find
+// the value that took the slot after it. Freed slots are used again first, so the vector is
+// only as long as the most values there have been at once. Ids are never 0.
+// Not thread safe, the owner locks around it.
+template <typename T>
+class SlotMap {
+    static constexpr unsigned index_bits = 20;
+    static constexpr unsigned index_mask = (1u << index_bits) - 1;
+    static constexpr unsigned max_generation = (1u << (32 - index_bits)) - 1;
+
+    struct Slot {
+        unsigned generation = 1;
+        bool used = false;
+        T value{};
+    };
+
+    std::vector<Slot> slots;
+    std::vector<unsigned> free_slots;
+    size_t count = 0;
+
+public:
+    static constexpr size_t max_size = index_mask + 1;
+
+    // 0 when every slot is taken
+    unsigned insert(T value) {
+        unsigned index;
+        if (!free_slots.empty()) {
+            index = free_slots.back();
+            free_slots.pop_back();
+        }
+        else if (slots.size() < max_size) {
+            index = static_cast<unsigned>(slots.size());
+            slots.emplace_back();
+        }
+        else
+            return 0;
+        auto& slot = slots[index];
+        slot.used = true;
+        slot.value = std::move(value);
+        ++count;
+        return slot.generation << index_bits | index;
+    }
+
+    T* find(unsigned id) {
+        auto index = id & index_mask;
+        if (index >= slots.size())
+            return nullptr;
+        auto& slot = slots[index];
+        if (!slot.used || slot.generation != id >> index_bits)
+            return nullptr;
+        return &slot.value;
+    }
+
+    // Moves the value out and frees its slot
+    T erase(unsigned id) {
+        auto value = find(id);
+        if (!value)
+            return T{};
+        auto index = id & index_mask;
+        auto& slot = slots[index];
+        T res = std::move(slot.value);
+        slot.value = T{};
+        slot.used = false;
+        slot.generation = slot.generation == max_generation ? 1 : slot.generation + 1;
+        free_slots.push_back(index);
+        --count;
+        return res;
+    }
+
+    size_t size() const {
+        return count;
+    }
+
+    size_t slot_count() const {
+        return slots.size();
+    }
+};
+
+#endif
@@ -21,6 +21,15 @@ public:
         return "SPLENDOR";
     }
 
+    virtual int get_max_players() {
+        return 4;
+    }
+
+    virtual void recycle() {
+        Room<SendMsgFunc>::recycle();
+        game.reset();
+    }
+
     virtual void process_message(
         unsigned conn_id,
         const std::string& user_name,
@@ -0,0 +1,123 @@
+#ifndef TIMER_WHEEL_HPP
+#define TIMER_WHEEL_HPP
+
+#include <list>
+#include <vector>
+#include <unordered_map>
+#include <cstddef>
+#include <algorithm>
+
+// Hierarchical timer wheel. The first level has a slot per tick, each level above has a slot
+// per turn of the one below, so a timer far ahead is moved down a level at a time as it gets
+// close, and advancing the clock only visits the slots that were passed.
+// Scheduling and cancelling are O(1), a timer is found again by the id schedule returned.
+// A timer expires once the whole tick it is due in has passed, so at most a tick late.
+// Not thread safe, the owner locks around it.
+template <typename Task>
+class TimerWheel {
+public:
+    typedef unsigned long long Id;
+
+private:
+    static constexpr unsigned level_bits = 8;
+    static constexpr unsigned levels = 4;
+    static constexpr long long slot_count = 1LL << level_bits;
+    // Timers beyond this many ticks wait in the last level and are placed again when it turns
+    static constexpr long long max_ticks = 1LL << (level_bits * levels);
+
+    struct Timer {
+        Id id;
+        long long due_tick;
+        unsigned level;
+        long long slot;
+        Task task;
+    };
+    typedef std::list<Timer> Slot;
+
+    std::vector<std::vector<Slot>> slots;
+    std::unordered_map<Id, typename Slot::iterator> timers;
+    long long tick_length;
+    long long current_tick;     // The last tick that was processed, it has fully passed
+    Id next_id = 0;
+
+public:
+    // Times are in any unit, as long as schedule and advance use the same one
+    TimerWheel(long long tick_length, long long now)
+        :slots(levels, std::vector<Slot>(slot_count)), tick_length(tick_length), current_tick(now / tick_length - 1) {
+    }
+
+    // A timer already due expires with the next tick
+    Id schedule(long long due, Task task) {
+        auto tick = due / tick_length;
+        if (tick <= current_tick)
+            tick = current_tick + 1;
+        Slot staging;
+        staging.push_back({ ++next_id, tick, 0, 0, std::move(task) });
+        auto it = staging.begin();
+        place(staging, it);
+        timers[next_id] = it;
+        return next_id;
+    }
+
+    // False if the timer has expired or was cancelled already
+    bool cancel(Id id) {
+        auto it = timers.find(id);
+        if (it == timers.end())
+            return false;
+        auto& timer = *it->second;
+        slots[timer.level][timer.slot].erase(it->second);
+        timers.erase(it);
+        return true;
+    }
+
+    // Calls expire(task) for the timers of every tick that has passed by now.
+    // A timer is taken off the wheel before its task is called, so expire may schedule and cancel
+    template <typename F>
+    void advance(long long now, F expire) {
+        auto target = now / tick_length - 1;
+        while (current_tick < target) {
+            ++current_tick;
+
+            // The levels above hand down the timers of the turn that starts now
+            for (unsigned level = levels - 1; level > 0; --level) {
+                if (current_tick & ((1LL << (level_bits * level)) - 1))
+                    continue;
+                auto& slot = slots[level][(current_tick >> (level_bits * level)) & (slot_count - 1)];
+                while (!slot.empty()) {
+                    auto it = slot.begin();
+                    place(slot, it);
+                }
+            }
+
+            auto& slot = slots[0][current_tick & (slot_count - 1)];
+            if (slot.empty())
+                continue;
+            Slot due;
+            due.splice(due.end(), slot);
+            for (auto& timer : due)
+                timers.erase(timer.id);
+            for (auto& timer : due)
+                expire(timer.task);
+        }
+    }
+
+    size_t size() const {
+        return timers.size();
+    }
+
+private:
+    // Moves the timer from the list it is in to its slot, the iterator stays valid
+    void place(Slot& from, typename Slot::iterator it) {
+        auto ticks = std::min(it->due_tick - current_tick, max_ticks - 1);
+        unsigned level = 0;
+        while (level + 1 < levels && ticks >= (1LL << (level_bits * (level + 1))))
+            ++level;
+        auto tick = current_tick + ticks;
+        it->level = level;
+        it->slot = (tick >> (level_bits * level)) & (slot_count - 1);
+        auto& to = slots[level][it->slot];
+        to.splice(to.end(), from, it);
+    }
+};
+
+#endif
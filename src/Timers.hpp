@@ -0,0 +1,93 @@
+#ifndef TIMERS_HPP
+#define TIMERS_HPP
+
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <chrono>
+#include <atomic>
+
+#include <json/json.h>
+
+#include "TimerWheel.hpp"
+
+// The timers of the whole server on one wheel and one thread: idle rooms, the grace period
+// of a game whose players all dropped, session expiry.
+// Tasks run on the timer thread without the wheel locked, so they may schedule and cancel,
+// but they should be short. A task can still run after cancel returned false, when it was
+// already due, so a task checks that what it is for is still there.
+class Timers {
+public:
+    typedef TimerWheel<std::function<void()>>::Id Id;
+
+private:
+    static constexpr std::chrono::milliseconds tick{ 100 };
+
+    TimerWheel<std::function<void()>> wheel{ tick.count(), now() };
+    std::mutex mutex;
+
+    std::atomic<unsigned long long> scheduled{ 0 };
+    std::atomic<unsigned long long> cancelled{ 0 };
+    std::atomic<unsigned long long> fired{ 0 };
+
+    Timers() {
+        std::thread t(std::bind(&Timers::run, this));
+        t.detach();
+    }
+
+public:
+    static Timers& get_instance() {
+        static Timers instance;
+        return instance;
+    }
+
+    Id schedule(std::chrono::milliseconds delay, std::function<void()> task) {
+        ++scheduled;
+        std::lock_guard<std::mutex> lock(mutex);
+        return wheel.schedule(now() + delay.count(), std::move(task));
+    }
+
+    bool cancel(Id id) {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (!wheel.cancel(id))
+            return false;
+        ++cancelled;
+        return true;
+    }
+
+    Json::Value get_stats() {
+        Json::Value res;
+        res["scheduled"] = static_cast<Json::UInt64>(scheduled.load());
+        res["cancelled"] = static_cast<Json::UInt64>(cancelled.load());
+        res["fired"] = static_cast<Json::UInt64>(fired.load());
+        std::lock_guard<std::mutex> lock(mutex);
+        res["pending"] = static_cast<Json::UInt64>(wheel.size());
+        return res;
+    }
+
+private:
+    // Milliseconds of the steady clock, so a change of the wall clock moves no timer
+    static long long now() {
+        return std::chrono::duration_cast<std::chrono::milliseconds>(
+            std::chrono::steady_clock::now().time_since_epoch()
+        ).count();
+    }
+
+    void run() {
+        while (true) {
+            std::this_thread::sleep_for(tick);
+            std::vector<std::function<void()>> due;
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                wheel.advance(now(), [&due](std::function<void()>& task) {
+                    due.push_back(std::move(task));
+                    });
+            }
+            fired += due.size();
+            for (auto& task : due)
+                task();
+        }
+    }
+};
+
+#endif
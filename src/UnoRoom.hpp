@@ -21,6 +21,15 @@ public:
         return "UNO";
     }
 
+    virtual int get_max_players() {
+        return 10;
+    }
+
+    virtual void recycle() {
+        Room<SendMsgFunc>::recycle();
+        uno_game.reset();
+    }
+
     virtual void process_message(
         unsigned conn_id,
         const std::string& user_name,
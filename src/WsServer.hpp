@@ -7,6 +7,9 @@
 #include <memory>
 #include <mutex>
 #include <thread>
+#include <vector>
+#include <functional>
+#include <cstdlib>
 
 #include <websocketpp/config/asio_no_tls.hpp>
 #include <websocketpp/server.hpp>
@@ -16,6 +19,10 @@
 #include "RoomManager.hpp"
 #include "Authorizer.hpp"
 #include "ChatHistory.hpp"
+#include "Cookie.hpp"
+#include "DbExecutor.hpp"
+#include "EventBus.hpp"
+#include "Presence.hpp"
 
 typedef websocketpp::server<websocketpp::config::asio> server;
 //typedef websocketpp::log::basic<websocketpp::concurrency::basic, websocketpp::log::elevel> basic_elog;
@@ -34,7 +41,8 @@ struct Connection {
 enum ActionType {
     SUBSCRIBE,
     UNSUBSCRIBE,
-    MESSAGE
+    MESSAGE,
+    EVENT       // From the EventBus, for every connection of user_id
 };
 
 struct Action {
@@ -42,10 +50,21 @@ struct Action {
     Action(ActionType t, connection_hdl h, server::message_ptr m)
         : type(t), hdl(h), msg(m) {
     }
+    // A connection that was authenticated during the handshake
+    Action(ActionType t, connection_hdl h, int id, const std::string& name)
+        : type(t), hdl(h), user_id(id), user_name(name) {
+    }
+    Action(ActionType t, int id, const std::string& p)
+        : type(t), user_id(id), payload(p) {
+    }
 
     ActionType             type;
     connection_hdl          hdl;
     server::message_ptr     msg;
+    int                     user_id = 0;
+    std::string             user_name;
+    bool                    bootstrap = false;
+    std::string             payload;
 };
 
 struct Response {
@@ -71,6 +90,8 @@ class WsServer {
         room_manager;
     Authorizer& auth = Authorizer::get_instance();
     ChatHistory& chat_history = ChatHistory::get_instance();
+    DbExecutor& db = DbExecutor::get_instance();
+    Presence& presence = Presence::get_instance();
 
     //basic_elog elogger;
 
@@ -78,16 +99,37 @@ public:
     WsServer():room_manager(std::bind(&WsServer::push_message, this, ::_1, ::_2)) {
         // Initialize Asio transport
         svr.init_asio();
+        // The server closes every plain HTTP connection, which leaves them in TIME_WAIT on this side
+        svr.set_reuse_addr(true);
 
         // Set callbacks
+        svr.set_validate_handler(std::bind(&WsServer::on_validate, this, ::_1));
         svr.set_open_handler(std::bind(&WsServer::on_open, this, ::_1));
         svr.set_close_handler(std::bind(&WsServer::on_close, this, ::_1));
         svr.set_message_handler(std::bind(&WsServer::on_message, this, ::_1, ::_2));
 
         //elogger.set_channels(websocketpp::log::elevel::info);
+
+        // Events are handed to the processing thread, which owns user_id_2_conn_id
+        EventBus::get_instance().subscribe([this](int user_id, const std::string& payload) {
+            {
+                std::lock_guard<std::mutex> guard(action_lock);
+                actions.push(Action(EVENT, user_id, payload));
+            }
+            action_cond.notify_one();
+            });
     }
 
-    void run(uint16_t port) {
+    // Plain HTTP requests to the WebSocket port are passed to handler, on the same threads
+    void set_http_handler(std::function<void(server::connection_ptr)> handler, size_t max_body_size) {
+        svr.set_max_http_body_size(max_body_size);
+        svr.set_http_handler([this, handler](connection_hdl hdl) {
+            handler(svr.get_con_from_hdl(hdl));
+            });
+    }
+
+    // The io_context is run by threads threads, this one included
+    void run(uint16_t port, unsigned threads = 1) {
         // listen on specified port
         svr.listen(port);
 
@@ -98,19 +140,50 @@ public:
         try {
             std::thread t1(std::bind(&WsServer::send_message, this));
             t1.detach();
-            std::thread t2(std::bind(&decltype(room_manager)::check_empty_rooms, &room_manager));
+            std::thread t2(std::bind(&decltype(room_manager)::publish_room_list_changes, &room_manager));
             t2.detach();
+            std::vector<std::thread> pool;
+            for (unsigned i = 1; i < threads; ++i)
+                pool.emplace_back([this] { svr.run(); });
             svr.run();
+            for (auto& t : pool)
+                t.join();
         }
         catch (const std::exception& e) {
             std::cout << e.what() << std::endl;
         }
     }
 
+    // The session is checked during the handshake, a connection without one is refused with 401
+    bool on_validate(connection_hdl hdl) {
+        auto con = svr.get_con_from_hdl(hdl);
+        int id;
+        std::string user_name;
+        if (authenticate(con, id, user_name))
+            return true;
+        con->set_status(websocketpp::http::status_code::unauthorized);
+        return false;
+    }
+
     void on_open(connection_hdl hdl) {
+        auto con = svr.get_con_from_hdl(hdl);
+        int id;
+        std::string user_name;
+        // Checked again, the session may have ended since the handshake was validated
+        if (!authenticate(con, id, user_name)) {
+            try {
+                con->close(websocketpp::close::status::policy_violation, "PLEASE_LOG_IN");
+            }
+            catch (const std::exception& e) {
+            }
+            return;
+        }
+        Action action(SUBSCRIBE, hdl, id, user_name);
+        // ?bootstrap=1 asks for AUTHORIZE_RES with the bootstrap bundle as soon as the connection opens
+        action.bootstrap = query_param(con->get_resource(), "bootstrap") == "1";
         {
             std::lock_guard<std::mutex> guard(action_lock);
-            actions.push(Action(SUBSCRIBE, hdl));
+            actions.push(action);
         }
         action_cond.notify_one();
     }
@@ -161,21 +234,34 @@ public:
 
                 // Authorized connection
                 if (connections.count(a.hdl)) {
+                    // The connection was authorized during the handshake, older clients still ask
+                    if (message_type == "AUTHORIZE") {
+                        auto& conn = connections[a.hdl];
+                        send_authorize_res(conn.conn_id, conn.user_id, conn.user_name, msg["bootstrap"].asBool());
+                    }
                     // ˽
-                    if (message_type == "WHISPER_MESSAGE") {
+                    else if (message_type == "WHISPER_MESSAGE") {
                         int receiver_id = msg["receiver_id"].asInt();
+                        long long message_id = chat_history.next_message_id();
+                        long long timestamp = chat_history.get_timestamp();
+                        msg["message"]["id"] = static_cast<int64_t>(message_id);
                         msg["message"]["user_name"] = connections[a.hdl].user_name;
                         msg["message"]["user_id"] = connections[a.hdl].user_id;
-                        msg["message"]["timestamp"] = static_cast<int64_t>(chat_history.get_timestamp());
+                        msg["message"]["timestamp"] = static_cast<int64_t>(timestamp);
+                        Json::FastWriter body_writer;
+                        body_writer.omitEndingLineFeed();
                         chat_history.new_chat_message(
+                            message_id,
                             connections[a.hdl].user_id,
                             receiver_id,
-                            Json::FastWriter().write(msg["message"])
+                            timestamp,
+                            body_writer.write(msg["message"])
                         );
                         auth.add_one_unread(receiver_id, connections[a.hdl].user_id);
+                        auto payload_str = Json::FastWriter().write(msg);
                         try {
                             svr.send(
-                                a.hdl, Json::FastWriter().write(msg),
+                                a.hdl, payload_str,
                                 websocketpp::frame::opcode::TEXT
                             );
                         }
@@ -184,10 +270,7 @@ public:
                         if (user_id_2_conn_id.count(receiver_id)) {
                             auto [begin, end] = user_id_2_conn_id.equal_range(receiver_id);
                             for (auto it = begin; it != end; ++it)
-                                push_message(
-                                    it->second,
-                                    Json::FastWriter().write(msg)
-                                );
+                                push_message(it->second, payload_str);
                         }
                     }
                     else if (message_type == "READ_WHISPER_MESSAGES") {
@@ -205,43 +288,12 @@ public:
                             msg
                         );
                 }
-                // Need Authorize
+                // Connections are only registered by SUBSCRIBE after the handshake authenticated them,
+                // so this one failed the check in on_open and is being closed
                 else {
-                    if (message_type != "AUTHORIZE") {
-                        // ȵ¼
-                        Json::Value res;
-                        res["message_type"] = "PLEASE_LOG_IN";
-                        try {
-                            svr.send(
-                                a.hdl, Json::FastWriter().write(res),
-                                websocketpp::frame::opcode::TEXT
-                            );
-                        }
-                        catch (const std::exception& e) {
-                        }
-                        break;
-                    }
-                    
-                    // Authദ
-                    unsigned sessdata = msg["sessdata"].asUInt();
-                    int id;
-                    std::string user_name;
-                    Authorizer::Result result =
-                        auth.authorize(sessdata, id, user_name);
-
+                    // ȵ¼
                     Json::Value res;
-                    res["message_type"] = "AUTHORIZE_RES";
-                    if (result == Authorizer::Result::SUCCESS) {
-                        res["success"] = true;
-                        res["id"] = id;
-                        res["user_name"] = user_name;
-                        connections[a.hdl] = { id, user_name, ++conn_id };
-                        conn_id_2_hdl[conn_id] = a.hdl;
-                        user_id_2_conn_id.emplace(id, conn_id);
-                    }
-                    else {
-                        res["success"] = false;
-                    }
+                    res["message_type"] = "PLEASE_LOG_IN";
                     try {
                         svr.send(
                             a.hdl, Json::FastWriter().write(res),
@@ -254,22 +306,105 @@ public:
                 break;
             }
 
+            case SUBSCRIBE: {
+                connections[a.hdl] = { a.user_id, a.user_name, ++conn_id };
+                conn_id_2_hdl[conn_id] = a.hdl;
+                user_id_2_conn_id.emplace(a.user_id, conn_id);
+                presence.connected(a.user_id);
+                if (a.bootstrap)
+                    send_authorize_res(conn_id, a.user_id, a.user_name, true);
+                break;
+            }
+
             case UNSUBSCRIBE: {
                 if (connections.count(a.hdl)) {
-                    room_manager.process_close(connections[a.hdl].conn_id, connections[a.hdl].user_id);
-                    conn_id_2_hdl.erase(connections[a.hdl].conn_id);
-                    user_id_2_conn_id.erase(connections[a.hdl].conn_id);
+                    auto& conn = connections[a.hdl];
+                    room_manager.process_close(conn.conn_id, conn.user_id);
+                    presence.disconnected(conn.user_id);
+                    conn_id_2_hdl.erase(conn.conn_id);
+                    // Only this connection, the user may have others
+                    auto [begin, end] = user_id_2_conn_id.equal_range(conn.user_id);
+                    for (auto it = begin; it != end; ++it)
+                        if (it->second == conn.conn_id) {
+                            user_id_2_conn_id.erase(it);
+                            break;
+                        }
                     connections.erase(a.hdl);
                 }
                 break;
             }
 
+            case EVENT: {
+                auto [begin, end] = user_id_2_conn_id.equal_range(a.user_id);
+                for (auto it = begin; it != end; ++it)
+                    push_message(it->second, a.payload);
+                break;
+            }
+
             default:
                 break;
             }
         }
     }
 
+    // With bootstrap, the response also carries what a client fetches when it starts: friends with
+    // unread counts, pending friend requests, its current room and the room list.
+    // Rooms are read here on the processing thread, the rest on the database executor,
+    // which sends the response when it is done.
+    void send_authorize_res(unsigned conn_id, int user_id, const std::string& user_name, bool bootstrap) {
+        Json::Value res;
+        res["message_type"] = "AUTHORIZE_RES";
+        res["success"] = true;
+        res["id"] = user_id;
+        res["user_name"] = user_name;
+        if (!bootstrap) {
+            push_message(conn_id, Json::FastWriter().write(res));
+            return;
+        }
+
+        res["bootstrap"]["room_id"] = room_manager.get_users_room_id(user_id);
+        res["bootstrap"]["room_list"] = room_manager.get_room_list();
+        db.post(DbExecutor::Priority::NORMAL,
+            [this, user_id] { return auth.get_friends_and_requests(user_id); },
+            [this, conn_id, res](Json::Value data) mutable {
+                res["bootstrap"]["friends"] = std::move(data["friends"]);
+                res["bootstrap"]["friend_requests"] = std::move(data["friend_requests"]);
+                push_message(conn_id, Json::FastWriter().write(res));
+            });
+    }
+
+    // A token or sessdata from the query string or the cookies of the handshake request.
+    // Both are checked in memory, so this does not hold up the asio thread.
+    bool authenticate(server::connection_ptr con, int& id, std::string& user_name) {
+        auto& resource = con->get_resource();
+        auto cookie = con->get_request_header("Cookie");
+
+        auto token = query_param(resource, "token");
+        if (token.empty())
+            token = Cookie::get(cookie, "token");
+        if (!token.empty() && auth.authorize_token(token, id, user_name) == Authorizer::Result::SUCCESS)
+            return true;
+
+        auto sessdata = query_param(resource, "sessdata");
+        if (sessdata.empty())
+            sessdata = Cookie::get(cookie, "sessdata");
+        return !sessdata.empty()
+            && auth.authorize(static_cast<unsigned>(std::strtoul(sessdata.c_str(), nullptr, 10)), id, user_name) == Authorizer::Result::SUCCESS;
+    }
+
+    // Tokens and sessdata need no percent-decoding
+    static std::string query_param(const std::string& resource, const std::string& name) {
+        auto pos = resource.find('?');
+        while (pos != std::string::npos) {
+            ++pos;
+            auto end = resource.find('&', pos);
+            if (resource.compare(pos, name.size(), name) == 0 && resource.size() > pos + name.size() && resource[pos + name.size()] == '=')
+                return resource.substr(pos + name.size() + 1, end == std::string::npos ? std::string::npos : end - pos - name.size() - 1);
+            pos = end;
+        }
+        return "";
+    }
+
     void send_message() {
         // Send responses
         while (true) {
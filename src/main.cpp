@@ -1,22 +1,45 @@
 #include <thread>
+#include <string>
+#include <cstdlib>
+#include <algorithm>
 
 #include "WsServer.hpp"
 #include "HttpServer.hpp"
 
-int main() {
+// unopp_server [--single-port] [--threads N]
+// With --single-port the HTTP API is served on the WebSocket port (1145) by the WebSocket
+// server's threads, instead of by a separate server on 1146.
+int main(int argc, char** argv) {
+    bool single_port = false;
+    unsigned threads = 1;
+    for (int i = 1; i < argc; ++i) {
+        std::string arg = argv[i];
+        if (arg == "--single-port")
+            single_port = true;
+        else if (arg == "--threads" && i + 1 < argc)
+            threads = std::max(1, std::atoi(argv[++i]));
+    }
+
     try {
         WsServer ws_server;
         HttpServer http_server;
 
         std::thread ws_process_th(std::bind(&WsServer::process_message, &ws_server));
-        std::thread http_th(std::bind(&HttpServer::run, &http_server, 1146));
+        std::thread http_th;
+        if (single_port)
+            ws_server.set_http_handler([&http_server](server::connection_ptr con) {
+                http_server.handle_http(con);
+                }, HttpServer::max_body_size);
+        else
+            http_th = std::thread(std::bind(&HttpServer::run, &http_server, 1146));
 
-        ws_server.run(1145);
+        ws_server.run(1145, threads);
 
-        http_th.join();
+        if (http_th.joinable())
+            http_th.join();
         ws_process_th.join();
     }
     catch (const std::exception& e) {
         std::cout << e.what() << std::endl;
     }
-}
+}
\ No newline at end of file